@@ -0,0 +1,108 @@
+#!/bin/sh -e
+# Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+# Compares the ways the installer gets a bootstrapped tree into a new chroot:
+# bootstrapping from a mirror, unpacking a bootstrap tarball (-f), and
+# restoring the bootstrap cache (savebootstrap/restorebootstrap in
+# installer/functions).
+
+APPLICATION="${0##*/}"
+SCRIPTDIR="`readlink -f "\`dirname "$0"\`/.."`"
+DIR='/var/tmp'
+MIRROR=''
+RELEASE='precise'
+RUNS=3
+TREE=''
+
+USAGE="$APPLICATION [-d dir] [-m mirror [-r release]] [-n runs] [-t tree]
+
+Reports the time to get a bootstrapped tree into an empty chroot directory,
+with cold caches, for each method. Must be run as root.
+
+The tree is bootstrapped with debootstrap from a mirror (a local mirror, e.g.
+file:///srv/mirror, stands in for the network without its variance), or taken
+from an existing directory. If neither is given, a copy of /usr stands in.
+
+Options:
+    -d dir      Directory on the filesystem to test. Default: $DIR
+    -m mirror   Mirror to bootstrap from with debootstrap; also times it.
+    -r release  Release to bootstrap from the mirror. Default: $RELEASE
+    -n runs     Number of runs of each method. Default: $RUNS
+    -t tree     Existing bootstrapped tree to use instead."
+
+while getopts 'd:m:n:r:t:' f; do
+    case "$f" in
+    d) DIR="$OPTARG";;
+    m) MIRROR="$OPTARG";;
+    n) RUNS="$OPTARG";;
+    r) RELEASE="$OPTARG";;
+    t) TREE="$OPTARG";;
+    \?) echo "$USAGE" 1>&2; exit 2;;
+    esac
+done
+shift "$((OPTIND-1))"
+
+if [ ! "`id -u`" = 0 ]; then
+    echo "$APPLICATION must be run as root." 1>&2
+    exit 2
+fi
+
+. "$SCRIPTDIR/installer/functions"
+
+TMP="`mktemp -d --tmpdir="$DIR" "$APPLICATION.XXX"`"
+trap "rm -rf '$TMP'" INT TERM HUP 0
+
+# Runs the command $@, and prints the time it took. Caches are dropped before,
+# and dirty data is written back before the time is taken.
+phase() {
+    local start
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    start="`date +%s%N`"
+    "$@" >/dev/null 2>&1
+    sync
+    printf ' %10.2f' "`echo "\`date +%s%N\` $start" \
+                            | awk '{print ($1-$2)/1e9}'`"
+}
+
+# Creates an empty chroot directory, replacing the previous one
+newchroot() {
+    rm -rf "$TMP/chroot"
+    mkdir "$TMP/chroot"
+}
+
+printf '%-10s' 'run'
+if [ -n "$MIRROR" ]; then
+    printf ' %10s' 'mirror'
+fi
+printf ' %10s %10s %10s\n' 'tarball' 'save cache' 'cache'
+
+for run in `seq "$RUNS"`; do
+    printf '%-10s' "$run"
+    if [ -n "$MIRROR" ]; then
+        newchroot
+        phase debootstrap --variant=minbase "$RELEASE" "$TMP/chroot" "$MIRROR"
+        if [ -z "$TREE" ]; then
+            mv "$TMP/chroot" "$TMP/tree"
+            TREE="$TMP/tree"
+        fi
+    elif [ -z "$TREE" ]; then
+        cp -a /usr "$TMP/tree"
+        TREE="$TMP/tree"
+    fi
+    if [ ! -f "$TMP/bootstrap.tar.bz2" ]; then
+        tar -C "$TREE" --numeric-owner -cjf "$TMP/bootstrap.tar.bz2" .
+    fi
+
+    # Same as installer/main.sh -f
+    newchroot
+    phase tar -C "$TMP/chroot" -xf "$TMP/bootstrap.tar.bz2"
+    phase savebootstrap "$TREE" "$TMP/cache" "crouton:bootstrap.bench"
+    newchroot
+    phase restorebootstrap "$TMP/cache" "$TMP/chroot"
+    echo
+done
+echo "(seconds; tree: `du -sh "$TREE" | cut -f1`," \
+     "`find "$TREE" | wc -l` files, `nproc` CPUs)"
@@ -0,0 +1,138 @@
+#!/bin/sh -e
+# Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+# Compares the I/O performance of the chroot encryption backends of
+# mount-chroot, on a plain Linux box: no encryption, ecryptfs (-e), and a
+# dm-crypt image (-E). The backends are set up the same way mount-chroot does,
+# with throwaway keys, in a temporary directory.
+
+APPLICATION="${0##*/}"
+BACKENDS='plain ecryptfs dmcrypt'
+DIR='/var/tmp'
+FILES=20000
+SIZE=512
+
+USAGE="$APPLICATION [-b backends] [-d dir] [-n files] [-s size]
+
+Runs a metadata-heavy workload (creating, listing and deleting many small files
+in a tree, like a package install) and a streaming workload (writing and reading
+back a large file, with cold caches) on each backend, and reports the time taken
+by each phase. Must be run as root.
+
+Options:
+    -b backends Backends to compare. Default: $BACKENDS
+    -d dir      Directory on the filesystem to test. Default: $DIR
+    -n files    Number of small files for the metadata workload. Default: $FILES
+    -s size     Size in MiB of the file for the streaming workload. Default: $SIZE"
+
+while getopts 'b:d:n:s:' f; do
+    case "$f" in
+    b) BACKENDS="$OPTARG";;
+    d) DIR="$OPTARG";;
+    n) FILES="$OPTARG";;
+    s) SIZE="$OPTARG";;
+    \?) echo "$USAGE" 1>&2; exit 2;;
+    esac
+done
+shift "$((OPTIND-1))"
+
+if [ ! "`id -u`" = 0 ]; then
+    echo "$APPLICATION must be run as root." 1>&2
+    exit 2
+fi
+
+TMP="`mktemp -d --tmpdir="$DIR" "$APPLICATION.XXX"`"
+DMNAME="crouton-bench-$$"
+trap "umount '$TMP/mnt' 2>/dev/null || true
+      dmsetup remove '$DMNAME' 2>/dev/null || true
+      rm -rf '$TMP'" INT TERM HUP 0
+
+# Mounts the backend $1 on $TMP/mnt
+setup() {
+    mkdir -p "$TMP/src" "$TMP/mnt"
+    case "$1" in
+    plain)
+        mount --bind "$TMP/src" "$TMP/mnt";;
+    ecryptfs)
+        # Same options as mount-chroot, with throwaway keys
+        sig="`head -c 32 /dev/urandom | od -An -tx1 | tr -d ' \n' \
+              | ecryptfs-add-passphrase - | sed -n 's/.*\[\([0-9a-f]*\)\].*/\1/p'`"
+        mnt="ecryptfs_sig=$sig,ecryptfs_fnek_sig=$sig,no_sig_cache"
+        mnt="$mnt,ecryptfs_cipher=aes,ecryptfs_key_bytes=16"
+        mnt="$mnt,ecryptfs_passthrough=n,ecryptfs_unlink_sigs"
+        mount -i -t ecryptfs -o "$mnt" "$TMP/src" "$TMP/mnt" >/dev/null;;
+    dmcrypt)
+        # Same table as mount-chroot, with a throwaway key
+        image="$TMP/src/.dmcrypt"
+        truncate -s "$((SIZE*2+FILES/100+256))M" "$image"
+        loop="`losetup -f --show "$image"`"
+        table="0 $((`stat -c '%s' "$image"`/512)) crypt aes-xts-plain64"
+        table="$table `head -c 64 /dev/urandom | od -An -tx1 | tr -d ' \n'`"
+        if ! echo "$table 0 $loop 0 1 allow_discards" \
+                | dmsetup create "$DMNAME"; then
+            losetup -d "$loop"
+            exit 1
+        fi
+        losetup -d "$loop"
+        mkfs.ext4 -q -m 0 "/dev/mapper/$DMNAME"
+        mount -t ext4 -o discard "/dev/mapper/$DMNAME" "$TMP/mnt";;
+    *)
+        echo "$APPLICATION: unknown backend $1" 1>&2
+        exit 2;;
+    esac
+}
+
+# Unmounts and deletes the backend $1
+teardown() {
+    umount "$TMP/mnt"
+    if [ "$1" = 'dmcrypt' ]; then
+        dmsetup remove "$DMNAME"
+    fi
+    rm -rf "$TMP/src" "$TMP/mnt"
+}
+
+# Runs the command $@, and prints the time it took. Caches are dropped before,
+# and dirty data is written back before the time is taken.
+phase() {
+    local start
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    start="`date +%s%N`"
+    "$@"
+    sync
+    printf ' %10.2f' "`echo "\`date +%s%N\` $start" \
+                            | awk '{print ($1-$2)/1e9}'`"
+}
+
+# Metadata workload: FILES small files, 100 per directory
+mkfiles() {
+    awk -v n="$FILES" -v d="$TMP/mnt/tree" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            if (i % 100 == 0) {
+                dir = d "/" int(i / 100)
+                system("mkdir -p " dir)
+            }
+            f = dir "/" i
+            printf "%08d\n", i > f
+            close(f)
+        }
+    }'
+}
+
+printf '%-10s %10s %10s %10s %10s %10s\n' 'backend' 'create' 'list' \
+       'delete' 'write' 'read'
+for backend in $BACKENDS; do
+    setup "$backend"
+    printf '%-10s' "$backend"
+    phase mkfiles
+    phase sh -c "find '$TMP/mnt/tree' -type f | xargs cat >/dev/null"
+    phase rm -rf "$TMP/mnt/tree"
+    phase dd if=/dev/zero of="$TMP/mnt/stream" bs=1M count="$SIZE" \
+             conv=fsync 2>/dev/null
+    phase dd if="$TMP/mnt/stream" of=/dev/null bs=1M 2>/dev/null
+    echo
+    teardown "$backend"
+done
+echo "(seconds; metadata: $FILES files, streaming: $SIZE MiB)"
@@ -0,0 +1,74 @@
+#!/bin/sh -e
+# Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+# Measures how long a chroot cursor change takes to be mirrored by
+# croutoncursor, on a plain Linux box. Two Xvfb servers stand in for the chroot
+# (Xephyr) and Chromium OS X11 servers.
+
+APPLICATION="${0##*/}"
+BENCHDIR="`dirname "$0"`"
+CHROOTDISPLAY=':91'
+HOSTDISPLAY=':92'
+COUNT=1000
+CURSOR=''
+
+USAGE="$APPLICATION [-n count] [-c croutoncursor] [-- croutoncursor options]
+
+Starts two Xvfb servers ($CHROOTDISPLAY as the chroot, $HOSTDISPLAY as Chromium OS),
+runs croutoncursor between them, and reports the latency and throughput of
+cursor changes.
+
+Options:
+    -n count         Number of cursor changes to measure. Default: $COUNT
+    -c croutoncursor croutoncursor binary to benchmark. Default: build it from
+                     src/cursor.c
+Extra croutoncursor options (e.g. -d, -s 2) can be given after --."
+
+while getopts 'c:n:' f; do
+    case "$f" in
+    c) CURSOR="$OPTARG";;
+    n) COUNT="$OPTARG";;
+    \?) echo "$USAGE" 1>&2; exit 2;;
+    esac
+done
+shift "$((OPTIND-1))"
+
+if ! hash Xvfb 2>/dev/null; then
+    echo "$APPLICATION: Xvfb is required." 1>&2
+    exit 1
+fi
+
+TMP="`mktemp -d --tmpdir=/tmp "$APPLICATION.XXX"`"
+PIDS=''
+trap "kill \$PIDS 2>/dev/null; wait; rm -rf '$TMP'" INT TERM HUP 0
+
+# Build the latency driver, and croutoncursor if needed
+gcc -O2 -Wall "$BENCHDIR/cursorlatency.c" -lX11 -lXfixes \
+    -o "$TMP/cursorlatency"
+if [ -z "$CURSOR" ]; then
+    CURSOR="$TMP/croutoncursor"
+    gcc -O2 -Wall "$BENCHDIR/../src/cursor.c" -lX11 -lXfixes -lXrender \
+        -o "$CURSOR"
+fi
+
+# Start the X11 servers, and wait for them to accept connections
+for display in "$CHROOTDISPLAY" "$HOSTDISPLAY"; do
+    Xvfb "$display" -nolisten tcp -screen 0 1024x768x24 >/dev/null 2>&1 &
+    PIDS="$PIDS $!"
+done
+tries=50
+while ! DISPLAY="$CHROOTDISPLAY" xdpyinfo >/dev/null 2>&1 || \
+      ! DISPLAY="$HOSTDISPLAY" xdpyinfo >/dev/null 2>&1; do
+    if [ "$((tries-=1))" -le 0 ]; then
+        echo "$APPLICATION: Xvfb failed to start." 1>&2
+        exit 1
+    fi
+    sleep .1
+done
+
+DISPLAY="$HOSTDISPLAY" "$CURSOR" "$@" "$CHROOTDISPLAY" &
+PIDS="$PIDS $!"
+
+DISPLAY="$HOSTDISPLAY" "$TMP/cursorlatency" -n "$COUNT" "$CHROOTDISPLAY"
@@ -0,0 +1,163 @@
+/* Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Drives cursor changes on a "chroot" X11 server, and timestamps the moment
+ * croutoncursor applies them to the "host" X11 server specified in DISPLAY.
+ * Reports the latency distribution, as well as the throughput when changes
+ * are sent back-to-back.
+ *
+ * See cursor.sh for a wrapper that sets up the X11 servers.
+ */
+
+#include <X11/Xlib.h>
+#include <X11/cursorfont.h>
+#include <X11/extensions/Xfixes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Cursor shapes cycled through. Consecutive shapes must differ, otherwise the
+ * displayed cursor does not change. */
+static const unsigned int shapes[] = {
+    XC_left_ptr, XC_xterm, XC_hand2, XC_watch,
+    XC_crosshair, XC_fleur, XC_sb_h_double_arrow, XC_sb_v_double_arrow,
+};
+#define NSHAPES (sizeof(shapes)/sizeof(*shapes))
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Waits for up to timeout ms for a cursor change on the host display.
+ * Returns the number of changes received. */
+static int wait_host(Display *host_d, int xfixes_event, int timeout) {
+    struct pollfd fds;
+    int changes = 0;
+
+    fds.fd = ConnectionNumber(host_d);
+    fds.events = POLLIN;
+    while (1) {
+        while (XPending(host_d)) {
+            XEvent e;
+            XNextEvent(host_d, &e);
+            if (e.type == xfixes_event + XFixesCursorNotify)
+                changes++;
+        }
+        if (changes || poll(&fds, 1, timeout) <= 0)
+            return changes;
+    }
+}
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "Usage: %s [-n count] [-w warmup] chrootdisplay\n", argv0);
+    fprintf(stderr, "   Measures cursor mirroring latency between\n"
+                    "   chrootdisplay and DISPLAY.\n");
+    fprintf(stderr, "   -n: number of cursor changes to measure.\n");
+    fprintf(stderr, "   -w: number of initial changes that are not measured.\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int count = 1000;
+    int warmup = NSHAPES;
+    Display *chroot_d, *host_d;
+    Window chroot_w;
+    Cursor cursors[NSHAPES];
+    int xfixes_event, xfixes_error;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "n:w:")) != -1) {
+        switch (c) {
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc-1 || count <= 0 || warmup < 0)
+        usage(argv[0]);
+
+    if (!(host_d = XOpenDisplay(NULL))) {
+        fprintf(stderr, "Failed to open host display\n");
+        return 1;
+    }
+    if (!(chroot_d = XOpenDisplay(argv[optind]))) {
+        fprintf(stderr, "Failed to open chroot display %s\n", argv[optind]);
+        return 1;
+    }
+    if (!XFixesQueryExtension(host_d, &xfixes_event, &xfixes_error)) {
+        fprintf(stderr, "host is missing XFixes extension\n");
+        return 1;
+    }
+    XFixesSelectCursorInput(host_d, DefaultRootWindow(host_d),
+                            XFixesDisplayCursorNotifyMask);
+    XSync(host_d, False);
+
+    chroot_w = DefaultRootWindow(chroot_d);
+    for (i = 0; i < NSHAPES; i++)
+        cursors[i] = XCreateFontCursor(chroot_d, shapes[i]);
+
+    /* Latency: one change at a time, waiting for it to reach the host. */
+    double *latency = malloc(count * sizeof(double));
+    int lost = 0, n = 0;
+    for (i = 0; i < warmup+count; i++) {
+        double start = now_us();
+        XDefineCursor(chroot_d, chroot_w, cursors[i % NSHAPES]);
+        XFlush(chroot_d);
+        if (!wait_host(host_d, xfixes_event, 1000)) {
+            if (i >= warmup)
+                lost++;
+            continue;
+        }
+        if (i >= warmup)
+            latency[n++] = now_us() - start;
+    }
+    if (n == 0) {
+        fprintf(stderr, "No cursor change reached the host display. "
+                        "Is croutoncursor running?\n");
+        return 1;
+    }
+    qsort(latency, n, sizeof(double), compare_double);
+    double sum = 0;
+    for (i = 0; i < n; i++)
+        sum += latency[i];
+    printf("latency: %d changes, %d lost, mean %.1f us, p50 %.1f us, "
+           "p99 %.1f us, max %.1f us\n", n, lost, sum / n,
+           latency[n / 2], latency[(int) (n * 0.99)], latency[n-1]);
+
+    /* Throughput: back-to-back changes. croutoncursor may coalesce changes, so
+     * count what reaches the host until it has been quiet for 500ms. */
+    double start = now_us();
+    for (i = 0; i < count; i++) {
+        XDefineCursor(chroot_d, chroot_w, cursors[i % NSHAPES]);
+        XFlush(chroot_d);
+    }
+    int received = 0, r;
+    double end = start;
+    while ((r = wait_host(host_d, xfixes_event, 500)) > 0) {
+        received += r;
+        end = now_us();
+    }
+    printf("throughput: %d changes sent, %d applied, %.0f changes/s\n",
+           count, received, received / ((end - start) / 1e6));
+
+    free(latency);
+    XCloseDisplay(chroot_d);
+    XCloseDisplay(host_d);
+    return 0;
+}
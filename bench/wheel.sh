@@ -0,0 +1,78 @@
+#!/bin/sh -e
+# Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+# Use of this source code is governed by a BSD-style license that can be
+# found in the LICENSE file.
+
+# Replays a trace of XInput 2 events, recorded with croutonxi2event -R, into
+# the mouse wheel daemon (or the touch gesture recognizer) on a plain Linux
+# box, and reports how long the wheel clicks take to reach the X server (and
+# gestures to be recognized). An Xvfb server stands in for the chroot X11
+# server.
+
+APPLICATION="${0##*/}"
+BENCHDIR="`dirname "$0"`"
+DISPLAY=':93'
+XI2EVENT=''
+MODE='-w'
+
+USAGE="$APPLICATION [-g] [-c croutonxi2event] trace [-- croutonxi2event options]
+
+Starts an Xvfb server ($DISPLAY), replays the trace at its original pace through
+the mouse wheel daemon, and reports the latency of the wheel clicks. Options
+(e.g. -r, -c 0.3, or -u 80 with -g) can be given after --, to compare settings
+on the same trace.
+
+Options:
+    -c croutonxi2event croutonxi2event binary to benchmark. Default: build it
+                       from src/xi2event.c
+    -g                 Replay a touchscreen trace into the gesture recognizer,
+                       and also report the recognition latency."
+
+while getopts 'c:g' f; do
+    case "$f" in
+    c) XI2EVENT="$OPTARG";;
+    g) MODE='-g';;
+    \?) echo "$USAGE" 1>&2; exit 2;;
+    esac
+done
+shift "$((OPTIND-1))"
+
+if [ "$#" -lt 1 ]; then
+    echo "$USAGE" 1>&2
+    exit 2
+fi
+TRACE="$1"
+shift
+if [ "$1" = '--' ]; then
+    shift
+fi
+
+if ! hash Xvfb 2>/dev/null; then
+    echo "$APPLICATION: Xvfb is required." 1>&2
+    exit 1
+fi
+
+TMP="`mktemp -d --tmpdir=/tmp "$APPLICATION.XXX"`"
+PIDS=''
+trap "kill \$PIDS 2>/dev/null; wait; rm -rf '$TMP'" INT TERM HUP 0
+
+if [ -z "$XI2EVENT" ]; then
+    XI2EVENT="$TMP/croutonxi2event"
+    gcc -O2 -Wall "$BENCHDIR/../src/xi2event.c" -lX11 -lXi -lXtst -lm \
+        -o "$XI2EVENT"
+fi
+
+# Start the X11 server, and wait for it to accept connections
+Xvfb "$DISPLAY" -nolisten tcp -screen 0 1024x768x24 >/dev/null 2>&1 &
+PIDS="$PIDS $!"
+export DISPLAY
+tries=50
+while ! xdpyinfo >/dev/null 2>&1; do
+    if [ "$((tries-=1))" -le 0 ]; then
+        echo "$APPLICATION: Xvfb failed to start." 1>&2
+        exit 1
+    fi
+    sleep .1
+done
+
+"$XI2EVENT" "$MODE" "$@" -P "$TRACE"
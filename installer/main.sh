@@ -17,7 +17,9 @@ ARCH=''
 DISTRO=''
 DOWNLOADONLY=''
 ENCRYPT=''
+IMAGESIZE=''
 KEYFILE=''
+LAYERED=''
 MIRROR=''
 NAME=''
 PREFIX='/usr/local'
@@ -35,7 +37,9 @@ $APPLICATION [options] -d -f tarball
 Constructs a chroot for running a more standard userspace alongside Chromium OS.
 
 If run with -f, a tarball is used to bootstrap the chroot. If specified with -d,
-the tarball is created for later use with -f.
+the tarball is created for later use with -f. Otherwise, the bootstrap of each
+release and architecture is cached in the chroots directory, and reused by the
+next chroots of the same release.
 
 This must be run as root unless -d is specified AND fakeroot is installed AND
 /tmp is mounted exec and dev.
@@ -48,11 +52,21 @@ Options:
     -d          Downloads the bootstrap tarball but does not prepare the chroot.
     -e          Encrypt the chroot with ecryptfs using a passphrase.
                 If specified twice, prompt to change the encryption passphrase.
+    -E SIZE     Encrypt a new chroot at the block level instead, in a dm-crypt
+                image file of SIZE bytes (suffixes K, M, G...): faster than
+                ecryptfs, especially when installing packages or compiling.
+                Uses the same passphrase and keys.
     -f TARBALL  The tarball to use, or download to in the case of -d.
                 When using a prebuilt tarball, -a and -r are ignored.
     -k KEYFILE  File or directory to store the (encrypted) encryption keys in.
                 If unspecified, the keys will be stored in the chroot if doing a
                 first encryption, or auto-detected on existing chroots.
+    -l          Layered chroot: the release is bootstrapped once, into a base
+                layer shared read-only by all the layered chroots of the same
+                release and architecture, and the chroot is an overlay that
+                only stores its own changes. Requires overlayfs support in the
+                kernel. Cannot be combined with -e. See edit-chroot for how
+                layered chroots are backed up, moved and deleted.
     -m MIRROR   Mirror to use for bootstrapping and package installation.
                 Default depends on the release chosen.
                 Can only be specified during chroot creation and forced updates
@@ -86,13 +100,15 @@ secure as the passphrases you assign to them."
 . "$SCRIPTDIR/installer/functions"
 
 # Process arguments
-while getopts 'a:def:k:m:n:p:P:r:s:t:T:uV' f; do
+while getopts 'a:deE:f:k:lm:n:p:P:r:s:t:T:uV' f; do
     case "$f" in
     a) ARCH="$OPTARG";;
     d) DOWNLOADONLY='y';;
     e) ENCRYPT="${ENCRYPT:-"-"}e";;
+    E) IMAGESIZE="$OPTARG";;
     f) TARBALL="$OPTARG";;
     k) KEYFILE="$OPTARG";;
+    l) LAYERED='y';;
     m) MIRROR="$OPTARG";;
     n) NAME="$OPTARG";;
     p) PREFIX="`readlink -f "$OPTARG"`";;
@@ -128,6 +144,14 @@ if [ -n "$DOWNLOADONLY" -a -n "$UPDATE" ]; then
     error 2 "$USAGE"
 fi
 
+# Layered chroots cannot be encrypted, and only apply to new chroots
+if [ -n "$LAYERED" ] && [ -n "$ENCRYPT$IMAGESIZE$KEYFILE$DOWNLOADONLY" ]; then
+    error 2 "$USAGE"
+fi
+if [ -n "$LAYERED" ] && ! grep -q 'overlay$' /proc/filesystems; then
+    error 2 "Your kernel does not support overlayfs: cannot create a layered chroot."
+fi
+
 # MIRROR must not be specified on update
 if [ "$UPDATE" = 1 ]; then
     if [ -z "$MIRROR" ]; then
@@ -321,12 +345,29 @@ Either delete it, specify a different name (-n), or specify -u to update it."
     fi
 
     # Mount the chroot and update CHROOT path
-    if [ -n "$KEYFILE" ]; then
+    if [ -n "$LAYERED" -a -n "$create" ]; then
+        # The release is installed into the base layer first, if it is not
+        # there yet; the chroot is then mounted on top of it.
+        LAYER="$RELEASE-$ARCH"
+        LAYERDIR="$CHROOTS/.layers/$LAYER"
+        if [ -f "$LAYERDIR/.crouton-layer" ]; then
+            echo "Using the $LAYER base layer for $NAME" 1>&2
+            NODOWNLOAD='y'
+            CHROOT="`sh -e "$HOSTBINDIR/mount-chroot" \
+                                -n -l "$LAYER" -p -c "$CHROOTS" "$NAME"`"
+        else
+            rm -rf --one-file-system "$LAYERDIR"
+            mkdir -p "$LAYERDIR"
+            CHROOT="$LAYERDIR"
+        fi
+    elif [ -n "$KEYFILE" ]; then
         CHROOT="`sh -e "$HOSTBINDIR/mount-chroot" -k "$KEYFILE" \
-                            $create $ENCRYPT -p -c "$CHROOTS" "$NAME"`"
+                            $create $ENCRYPT ${IMAGESIZE:+-E "$IMAGESIZE"} \
+                            -p -c "$CHROOTS" "$NAME"`"
     else
         CHROOT="`sh -e "$HOSTBINDIR/mount-chroot" \
-                            $create $ENCRYPT -p -c "$CHROOTS" "$NAME"`"
+                            $create $ENCRYPT ${IMAGESIZE:+-E "$IMAGESIZE"} \
+                            -p -c "$CHROOTS" "$NAME"`"
     fi
 
     # Auto-unmount the chroot when the script exits
@@ -416,20 +457,29 @@ elif [ -z "$DOWNLOADONLY" ] && \
     }
 fi
 
-# Unpack the tarball if appropriate
+# Unpack the tarball or the cached bootstrap if appropriate
+BOOTSTRAPCACHE="$CHROOTS/.bootstrap/$RELEASE-$ARCH"
+CACHED=''
 if [ -z "$NODOWNLOAD" -a -z "$DOWNLOADONLY" ]; then
     echo "Installing $RELEASE-$ARCH chroot to $CHROOT" 1>&2
     if [ -n "$TARBALL" ]; then
         # Unpack the chroot
         echo 'Unpacking chroot environment...' 1>&2
         tar -C "$CHROOT" --strip-components=1 -xf "$TARBALL"
+    elif [ -f "$BOOTSTRAPCACHE/.crouton-bootstrap" ]; then
+        echo "Unpacking cached $RELEASE-$ARCH bootstrap..." 1>&2
+        # Make sure we do not leave an incomplete chroot
+        addtrap "rm -rf '$CHROOT'"
+        restorebootstrap "$BOOTSTRAPCACHE" "$CHROOT"
+        undotrap
+        CACHED='y'
     fi
 elif [ -z "$NODOWNLOAD" ]; then
     echo "Downloading $RELEASE-$ARCH bootstrap to $TARBALL" 1>&2
 fi
 
 # Download the bootstrap data if appropriate
-if [ -z "$NODOWNLOAD" ] && [ -n "$DOWNLOADONLY" -o -z "$TARBALL" ]; then
+if [ -z "$NODOWNLOAD$CACHED" ] && [ -n "$DOWNLOADONLY" -o -z "$TARBALL" ]; then
     # Create the temporary directory and delete it upon exit
     tmp="`mktemp -d --tmpdir=/tmp "$APPLICATION.XXX"`"
     subdir="$RELEASE-$ARCH"
@@ -452,6 +502,13 @@ if [ -z "$NODOWNLOAD" ] && [ -n "$DOWNLOADONLY" -o -z "$TARBALL" ]; then
         exit 0
     fi
 
+    # Cache it for the next chroots of this release
+    echo "Caching $subdir bootstrap..." 1>&2
+    if ! savebootstrap "$tmp/$subdir" "$BOOTSTRAPCACHE" \
+                       "crouton:bootstrap.$subdir"; then
+        echo "WARNING: Unable to cache the $subdir bootstrap." 1>&2
+    fi
+
     # Move it to the right place
     echo 'Moving bootstrap files into the chroot...' 1>&2
     # Make sure we do not leave an incomplete chroot in case of interrupt or
@@ -473,8 +530,7 @@ if set -o | grep -q '^verbose *on$'; then
     SETOPTIONS="$SETOPTIONS -v"
 fi
 
-# Create the setup script inside the chroot
-echo 'Preparing chroot environment...' 1>&2
+# Values substituted in the setup scripts
 VAREXPAND="s/releases=.*\$/releases=\"\
 `sed 's/$/\\\\/' "$DISTRODIR/releases"`
 \"/;"
@@ -482,6 +538,24 @@ VAREXPAND="${VAREXPAND}s #ARCH $ARCH ;s #MIRROR $MIRROR ;"
 VAREXPAND="${VAREXPAND}s #DISTRO $DISTRO ;s #RELEASE $RELEASE ;"
 VAREXPAND="${VAREXPAND}s #PROXY $PROXY ;s #VERSION ${VERSION:-"git"} ;"
 VAREXPAND="${VAREXPAND}s/#SETOPTIONS/$SETOPTIONS/;"
+
+# Finish bootstrapping the freshly installed base layer (debootstrap's second
+# stage, in the distro's prepare script), so that all the layered chroots share
+# it, then seal it and mount the chroot on top of it.
+if [ -n "$LAYERDIR" -a "$CHROOT" = "$LAYERDIR" ]; then
+    echo "Preparing the $LAYER base layer..." 1>&2
+    installscript "$INSTALLERDIR/prepare.sh" "$LAYERDIR/prepare.sh" "$VAREXPAND"
+    cat "$DISTRODIR/prepare" >> "$LAYERDIR/prepare.sh"
+    echo 'rm -f "$0"' >> "$LAYERDIR/prepare.sh"
+    chmod 500 "$LAYERDIR/prepare.sh"
+    sh -e "$HOSTBINDIR/enter-chroot" -c "$CHROOTS/.layers" -n "$LAYER" -xx
+    touch "$LAYERDIR/.crouton-layer"
+    CHROOT="`sh -e "$HOSTBINDIR/mount-chroot" \
+                        -n -l "$LAYER" -p -c "$CHROOTS" "$NAME"`"
+fi
+
+# Create the setup script inside the chroot
+echo 'Preparing chroot environment...' 1>&2
 installscript "$INSTALLERDIR/prepare.sh" "$CHROOT/prepare.sh" "$VAREXPAND"
 # Append the distro-specific prepare.sh
 cat "$DISTRODIR/prepare" >> "$CHROOT/prepare.sh"
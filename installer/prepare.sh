@@ -150,6 +150,54 @@ list_uninstalled() {
 }
 
 
+# prefetch: Plans the installation ahead of the targets. Collects the packages
+# of every unconditional install and compile call in this script, resolves them
+# all at once, and downloads them to the package cache, so that the install
+# calls that follow only have to unpack them. Packages that are conditionally
+# installed are simply fetched when they are installed.
+# Failures are not fatal: the install calls will report any actual problem.
+prefetch() {
+    local line minimal='' full='' mode
+    # Join continued lines, and print unconditional install/compile calls
+    awk '
+        { line = line $0 }
+        /\\$/ { sub(/\\$/, "", line); next }
+        line ~ /^(install|compile) / && line !~ /[$`]/ {
+            sub(/ *<<EOF$/, "", line); print line
+        }
+        { line = "" }
+    ' "$0" | {
+        while read line; do
+            eval "set -- $line"
+            if [ "$1" = 'compile' ]; then
+                shift 3
+                minimal="$minimal gcc arch=,libc6-dev"
+                set -- --minimal "$@"
+            else
+                shift
+            fi
+            mode=''
+            while [ "$#" != 0 -a ! "$1" = '--' ]; do
+                case "$1" in
+                --minimal) mode='minimal';;
+                --asdeps) ;;
+                *) if [ "$mode" = 'minimal' ]; then
+                       minimal="$minimal $1"
+                   else
+                       full="$full $1"
+                   fi;;
+                esac
+                shift
+            done
+        done
+        minimal="`distropkgs $minimal`"
+        full="`distropkgs $full`"
+        echo 'Fetching packages...' 1>&2
+        prefetch_dist "$minimal" "$full"
+    } || echo 'Failed to fetch packages; they will be fetched on install.' 1>&2
+}
+
+
 # Requests a re-launch of the preparation script with a fresh chroot setup.
 # Generally called immediately after bootstrapping to fix the environment.
 relaunch_setup() {
@@ -0,0 +1,228 @@
+/* Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Core dump writer: called by crash_reporter_wrapper inside the chroot of a
+ * crashing process, with the core on stdin (the pipe from the kernel), to
+ * write it to the file requested by the chroot's core_pattern. This replaces
+ * a shell running cat or head under su, so that large cores do not go through
+ * extra processes and pipes while the kernel waits.
+ *
+ * The core is read in large chunks, and blocks of zeros (which the kernel
+ * writes for unpopulated pages, as it cannot seek in a pipe) are skipped, so
+ * that the file is sparse. Files with a .gz extension are compressed (fast
+ * level) with zlib.
+ *
+ * At most -l bytes are written (the core size limit of the process). Like
+ * the kernel, existing files are only overwritten if they are regular files
+ * with a single link. Privileges are dropped to -u/-g before opening the file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Size of the chunks read from the kernel */
+#define CHUNK_SIZE (1 << 20)
+/* Granularity of the holes in sparse files */
+#define BLOCK_SIZE 4096
+
+/* Returns the number of bytes to read next, given the remaining limit. */
+static size_t next_size(long long limit) {
+    return (limit >= 0 && limit < CHUNK_SIZE) ? limit : CHUNK_SIZE;
+}
+
+/* Fills buffer with up to size bytes from stdin. Returns the number of bytes
+ * read, which is less than size only at the end of the core, or -1. */
+static ssize_t read_full(char *buffer, size_t size) {
+    size_t n = 0;
+    ssize_t r;
+    while (n < size) {
+        r = read(STDIN_FILENO, buffer+n, size-n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            perror("Cannot read core");
+            return -1;
+        }
+        if (r == 0)
+            break;
+        n += r;
+    }
+    return n;
+}
+
+/* Writes size bytes of buffer to fd. Returns 0 on success. */
+static int write_full(int fd, const char *buffer, size_t size) {
+    ssize_t r;
+    while (size > 0) {
+        r = write(fd, buffer, size);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            perror("Cannot write core");
+            return -1;
+        }
+        buffer += r;
+        size -= r;
+    }
+    return 0;
+}
+
+/* Returns 1 if the size bytes of buffer are all zero. */
+static int is_zero(const char *buffer, size_t size) {
+    return buffer[0] == 0 && !memcmp(buffer, buffer+1, size-1);
+}
+
+/* Copies the core to fd, leaving holes for blocks of zeros. */
+static int write_sparse(int fd, long long limit) {
+    char *buffer = malloc(CHUNK_SIZE);
+    off_t total = 0;
+    ssize_t n;
+    size_t i, start, block;
+    int ret = -1;
+
+    if (!buffer) {
+        perror("Cannot allocate buffer");
+        return -1;
+    }
+    while ((n = read_full(buffer, next_size(limit))) > 0) {
+        /* Write runs of non-zero blocks, seek over runs of zero blocks */
+        for (start = i = 0; i < n; i += block) {
+            block = (n-i < BLOCK_SIZE) ? n-i : BLOCK_SIZE;
+            if (!is_zero(buffer+i, block))
+                continue;
+            if (write_full(fd, buffer+start, i-start) < 0)
+                goto out;
+            if (lseek(fd, block, SEEK_CUR) < 0) {
+                perror("Cannot seek in core");
+                goto out;
+            }
+            start = i+block;
+        }
+        if (write_full(fd, buffer+start, n-start) < 0)
+            goto out;
+        total += n;
+        if (limit >= 0 && (limit -= n) == 0)
+            break;
+    }
+    /* A trailing hole needs the file to be extended */
+    if (n >= 0 && ftruncate(fd, total) < 0)
+        perror("Cannot extend core");
+    else if (n >= 0)
+        ret = 0;
+out:
+    free(buffer);
+    return ret;
+}
+
+/* Compresses the core to fd. */
+static int write_gzip(int fd, long long limit) {
+    char *buffer = malloc(CHUNK_SIZE);
+    gzFile gz = gzdopen(fd, "wb1");
+    ssize_t n;
+    int ret = -1;
+
+    if (!buffer || !gz) {
+        fprintf(stderr, "Cannot set up compression.\n");
+        free(buffer);
+        return -1;
+    }
+    while ((n = read_full(buffer, next_size(limit))) > 0) {
+        if (gzwrite(gz, buffer, n) != n) {
+            fprintf(stderr, "Cannot compress core.\n");
+            break;
+        }
+        if (limit >= 0 && (limit -= n) == 0)
+            break;
+    }
+    if (gzclose(gz) != Z_OK)
+        fprintf(stderr, "Cannot write compressed core.\n");
+    else if (n >= 0)
+        ret = 0;
+    free(buffer);
+    return ret;
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "%s [-g gid] [-l limit] [-u uid] file\n", argv0);
+    fprintf(stderr, "   Writes the core dump on stdin to file, sparsely, or "
+                    "compressed if file\n   ends with .gz.\n");
+    fprintf(stderr, "   -g, -u: group and user to write the file as.\n");
+    fprintf(stderr, "   -l: maximum size of the core, -1 for unlimited.\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    long long limit = -1;
+    uid_t uid = -1;
+    gid_t gid = -1;
+    struct stat st;
+    char *file;
+    size_t len;
+    int c, fd, ret;
+
+    while ((c = getopt(argc, argv, "g:l:u:")) != -1) {
+        switch (c) {
+        case 'g': gid = strtoul(optarg, NULL, 10); break;
+        case 'l': limit = strtoll(optarg, NULL, 10); break;
+        case 'u': uid = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc-1)
+        usage(argv[0]);
+    file = argv[optind];
+    if (limit == 0)
+        return 0;
+
+    /* Write the file as the owner of the crashing process */
+    if ((gid != -1 && (setgroups(0, NULL) < 0 || setgid(gid) < 0)) ||
+            (uid != -1 && setuid(uid) < 0)) {
+        perror("Cannot drop privileges");
+        return 1;
+    }
+
+    /* Check the file before and after opening it, and only truncate it then.
+     * O_NOFOLLOW rejects symlinks, O_NONBLOCK does not wait on FIFOs. */
+    if (lstat(file, &st) == 0 && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Not overwriting '%s'; it is not a regular file\n",
+                file);
+        return 1;
+    }
+    fd = open(file, O_WRONLY|O_CREAT|O_NOFOLLOW|O_NOCTTY|O_NONBLOCK, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open '%s': %s\n", file, strerror(errno));
+        return 1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Not overwriting '%s'; it is not a regular file\n",
+                file);
+        return 1;
+    }
+    if (st.st_nlink != 1) {
+        fprintf(stderr, "Not overwriting '%s'; it is multiply linked\n", file);
+        return 1;
+    }
+    if (fcntl(fd, F_SETFL, 0) < 0 || ftruncate(fd, 0) < 0) {
+        perror("Cannot truncate core");
+        return 1;
+    }
+
+    len = strlen(file);
+    if (len > 3 && !strcmp(file+len-3, ".gz"))
+        return write_gzip(fd, limit) ? 1 : 0;
+    ret = write_sparse(fd, limit);
+    if (close(fd) < 0) {
+        perror("Cannot close core");
+        return 1;
+    }
+    return ret ? 1 : 0;
+}
@@ -4,28 +4,198 @@
  *
  * Monitors the specified X11 server for cursor change events, and copies the
  * cursor image over to the X11 server specified in DISPLAY.
+ *
+ * In multi-display mode (-d), a single process monitors any number of chroot
+ * X11 servers (usually Xephyr), multiplexing them in one poll loop, and only
+ * copies the cursor of the display that is currently focused on the Chromium
+ * OS X11 server. Displays can be attached (-a) and detached (-r) at runtime
+ * through a UNIX socket.
+ *
+ * Cursor images go through a pixel pipeline (64-bit to 32-bit ARGB conversion,
+ * premultiplied alpha validation and optional scaling), and the resulting
+ * cursors are cached on the Chromium OS X11 server.
  */
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/Xfixes.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "socket.h"
+
+/* Control socket used to attach/detach displays in multi-display mode */
+#define CONTROL_SOCKET "/tmp/crouton-cursor"
+/* Maximum number of chroot displays monitored by a single process */
+#define MAX_DISPLAYS 32
+/* Maximum length of a control command ("a:12.0\n") */
+#define MAX_COMMAND 64
+/* Number of converted cursors kept on the Chromium OS X11 server */
+#define CURSOR_CACHE_SIZE 32
+/* Limits on cursor scaling */
+#define MAX_SCALE 4
+#define MAX_CURSOR_SIZE 256
 
 static int error = 0;
+static int ignore_errors = 0;
+/* Cursor scaling factor, or 0 to match the DPI of the Chromium OS display */
+static double scale_factor = 1;
 
 static int error_handler(Display *d, XErrorEvent *e) {
+    if (ignore_errors)
+        return 0;
     fprintf(stderr, "X11 error: %d, %d, %d\n",
             e->error_code, e->request_code, e->minor_code);
     error = 1;
     return 0;
 }
 
-/* Apply the cursor to the Chromium OS X11 server.
+/* Returns the number of an X11 display name (e.g. 1 for ":1.0"), or -1. */
+static int display_number(const char *name) {
+    const char *colon = strrchr(name, ':');
+    char *end;
+    long n;
+    if (!colon || !colon[1])
+        return -1;
+    n = strtol(colon+1, &end, 10);
+    if (end == colon+1 || (*end && *end != '.'))
+        return -1;
+    return n;
+}
+
+/* Cursor pixel pipeline */
+
+/* XFixesCursorImage pixels are unsigned long, which is 64-bit on 64-bit
+ * platforms, while XRender expects packed 32-bit ARGB: convert them. */
+static void convert_pixels(uint32_t *dst, const unsigned long *src, int n) {
+    int i = 0;
+
+    if (sizeof(unsigned long) == sizeof(uint32_t)) {
+        memcpy(dst, src, n * sizeof(uint32_t));
+        return;
+    }
+#if ULONG_MAX > 0xffffffffUL
+#if defined(__SSE2__)
+    /* Keep the low 32 bits of each 64-bit pixel, 4 pixels at a time. */
+    for (; i+4 <= n; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (src+i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (src+i+2));
+        a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+        b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128((__m128i *) (dst+i), _mm_unpacklo_epi64(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (; i+4 <= n; i += 4) {
+        uint64x2_t a = vld1q_u64((const uint64_t *) (src+i));
+        uint64x2_t b = vld1q_u64((const uint64_t *) (src+i+2));
+        vst1q_u32(dst+i, vcombine_u32(vmovn_u64(a), vmovn_u64(b)));
+    }
+#endif
+#endif
+    for (; i < n; i++)
+        dst[i] = src[i];
+}
+
+/* Cursors use premultiplied alpha, so no color channel may exceed alpha.
+ * Clamp invalid pixels, which would otherwise be rendered as garbage.
+ * Each alpha byte is replicated over the pixel, so that a bytewise minimum
+ * clamps all the channels at once. */
+static void clamp_premultiplied(uint32_t *p, int n) {
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i+4 <= n; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (p+i));
+        __m128i a = _mm_srli_epi32(x, 24);
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+        a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+        _mm_storeu_si128((__m128i *) (p+i), _mm_min_epu8(x, a));
+    }
+#elif defined(__ARM_NEON)
+    for (; i+4 <= n; i += 4) {
+        uint32x4_t x = vld1q_u32(p+i);
+        uint32x4_t a = vshrq_n_u32(x, 24);
+        a = vorrq_u32(a, vshlq_n_u32(a, 8));
+        a = vorrq_u32(a, vshlq_n_u32(a, 16));
+        vst1q_u32(p+i, vreinterpretq_u32_u8(vminq_u8(vreinterpretq_u8_u32(x),
+                                                     vreinterpretq_u8_u32(a))));
+    }
+#endif
+    for (; i < n; i++) {
+        uint32_t a = p[i] >> 24;
+        uint32_t r = (p[i] >> 16) & 0xff;
+        uint32_t g = (p[i] >> 8) & 0xff;
+        uint32_t b = p[i] & 0xff;
+        p[i] = a << 24 | (r > a ? a : r) << 16 | (g > a ? a : g) << 8 |
+               (b > a ? a : b);
+    }
+}
+
+/* Nearest-neighbour scaling, using 16.16 fixed-point steps. */
+static void scale_pixels(uint32_t *dst, int dw, int dh,
+                         const uint32_t *src, int sw, int sh) {
+    uint32_t xstep = ((uint32_t) sw << 16) / dw;
+    uint32_t ystep = ((uint32_t) sh << 16) / dh;
+    uint32_t sy = 0;
+    int x, y;
+
+    for (y = 0; y < dh; y++, sy += ystep) {
+        const uint32_t *row = src + (sy >> 16) * sw;
+        uint32_t sx = 0;
+        for (x = 0; x < dw; x++, sx += xstep)
+            *dst++ = row[sx >> 16];
+    }
+}
+
+/* Returns the scaling factor to apply to cursors of the chroot display, so
+ * that they have the same physical size on the Chromium OS display. The
+ * factor is rounded to a multiple of 0.25 to avoid needless resampling. */
+static double display_scale(Display *cros_d, Display *chroot_d) {
+    int cros_mm = DisplayWidthMM(cros_d, DefaultScreen(cros_d));
+    int chroot_mm = DisplayWidthMM(chroot_d, DefaultScreen(chroot_d));
+    double scale;
+
+    if (scale_factor > 0)
+        return scale_factor;
+    if (cros_mm <= 0 || chroot_mm <= 0)
+        return 1;
+    /* Ratio of the DPIs */
+    scale = (double) DisplayWidth(cros_d, DefaultScreen(cros_d)) * chroot_mm /
+            DisplayWidth(chroot_d, DefaultScreen(chroot_d)) / cros_mm;
+    scale = (int) (scale * 4 + 0.5) / 4.0;
+    if (scale < 0.25)
+        return 0.25;
+    return scale > MAX_SCALE ? MAX_SCALE : scale;
+}
+
+/* Runs the image through the pixel pipeline, and creates the cursor on the
+ * Chromium OS X11 server.
  * Adapted from the XcursorImageLoadCursor implementation in libXcursor,
  * copyright 2002 Keith Packard.
  */
-static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
-    static Cursor cur_cursor = 0;
+static Cursor create_cursor(Display* d, Window w, XFixesCursorImage *image,
+                            double scale) {
+    static uint32_t *buffer = NULL;
+    static int buffer_size = 0;
+    int n = image->width * image->height;
+    int width = image->width * scale + 0.5;
+    int height = image->height * scale + 0.5;
+    uint32_t *pixels;
     XImage ximage;
     Pixmap pixmap;
     Picture picture;
@@ -33,63 +203,166 @@ static void apply_cursor(Display* d, Window w, XFixesCursorImage *image) {
     XRenderPictFormat *format;
     Cursor cursor;
 
-    /* Unset the current cursor if no image is passed. */
-    if (!image) {
-        if (cur_cursor) {
-            XUndefineCursor(d, w);
-            XFreeCursor(d, cur_cursor);
-            cur_cursor = 0;
+    if (n <= 0)
+        return 0;
+    if (width < 1)
+        width = 1;
+    if (height < 1)
+        height = 1;
+    if (width > MAX_CURSOR_SIZE)
+        width = MAX_CURSOR_SIZE;
+    if (height > MAX_CURSOR_SIZE)
+        height = MAX_CURSOR_SIZE;
+    if (width == image->width && height == image->height)
+        scale = 0;
+
+    /* Reuse the buffer between cursors: it only grows. The scaled image is
+     * stored after the converted one. */
+    int size = n + (scale ? width * height : 0);
+    if (size > buffer_size) {
+        uint32_t *new_buffer = realloc(buffer, size * sizeof(uint32_t));
+        if (!new_buffer) {
+            fprintf(stderr, "Cannot allocate cursor buffer\n");
+            return 0;
         }
-        return;
+        buffer = new_buffer;
+        buffer_size = size;
+    }
+
+    convert_pixels(buffer, image->pixels, n);
+    clamp_premultiplied(buffer, n);
+    pixels = buffer;
+    if (scale) {
+        pixels = buffer + n;
+        scale_pixels(pixels, width, height, buffer, image->width,
+                     image->height);
     }
 
-    ximage.width = image->width;
-    ximage.height = image->height;
+    ximage.width = width;
+    ximage.height = height;
     ximage.xoffset = 0;
     ximage.format = ZPixmap;
-    ximage.data = (char *) image->pixels;
+    ximage.data = (char *) pixels;
     ximage.byte_order = LSBFirst;
     ximage.bitmap_unit = 32;
     ximage.bitmap_bit_order = ximage.byte_order;
     ximage.bitmap_pad = 32;
     ximage.depth = 32;
     ximage.bits_per_pixel = 32;
-    ximage.bytes_per_line = image->width * 4;
+    ximage.bytes_per_line = width * 4;
     ximage.red_mask = 0xff0000;
     ximage.green_mask = 0x00ff00;
     ximage.blue_mask = 0x0000ff;
     ximage.obdata = 0;
     if (!XInitImage(&ximage)) {
         puts("failed to init image");
-        return;
+        return 0;
     }
-    pixmap = XCreatePixmap(d, w, image->width, image->height, 32);
+    pixmap = XCreatePixmap(d, w, width, height, 32);
     gc = XCreateGC(d, pixmap, 0, 0);
-    XPutImage(d, pixmap, gc, &ximage, 0, 0, 0, 0, image->width, image->height);
+    XPutImage(d, pixmap, gc, &ximage, 0, 0, 0, 0, width, height);
     XFreeGC(d, gc);
     format = XRenderFindStandardFormat(d, PictStandardARGB32);
     picture = XRenderCreatePicture(d, pixmap, format, 0, 0);
     XFreePixmap(d, pixmap);
-    cursor = XRenderCreateCursor(d, picture, image->xhot, image->yhot);
+    cursor = XRenderCreateCursor(d, picture,
+                                 image->xhot * width / image->width,
+                                 image->yhot * height / image->height);
     XRenderFreePicture(d, picture);
-    XDefineCursor(d, w, cursor);
-    XFlush(d);
-    if (cur_cursor)
-        XFreeCursor(d, cur_cursor);
-    cur_cursor = cursor;
+    return cursor;
 }
 
-int main(int argc, char** argv) {
-    if (argc != 2 || !argv[1][0] || !argv[1][1]) {
-        fprintf(stderr, "Usage: %s chrootdisplay\n", argv[0]);
-        return 2;
+/* Cursor cache */
+
+/* Cursors created on the Chromium OS X11 server, indexed by the chroot display
+ * number and the XFixes cursor serial, which identifies a cursor image on the
+ * chroot X11 server. Applications switch between a handful of cursors, so this
+ * avoids fetching and converting the image again in most cases. */
+struct cached_cursor {
+    int display;
+    unsigned long serial;
+    Cursor cursor;
+    unsigned long last_used; /* 0 if the entry is unused */
+};
+
+static struct cached_cursor cursor_cache[CURSOR_CACHE_SIZE];
+static unsigned long cursor_cache_clock = 0;
+
+static struct cached_cursor *cache_lookup(int display, unsigned long serial) {
+    int i;
+    for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+        struct cached_cursor *c = &cursor_cache[i];
+        if (c->last_used && c->display == display && c->serial == serial) {
+            c->last_used = ++cursor_cache_clock;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/* Adds a cursor to the cache, evicting the least recently used one. */
+static struct cached_cursor *cache_insert(Display *d, int display,
+                                          unsigned long serial, Cursor cursor) {
+    struct cached_cursor *c = &cursor_cache[0];
+    int i;
+    for (i = 1; i < CURSOR_CACHE_SIZE && c->last_used; i++) {
+        if (cursor_cache[i].last_used < c->last_used)
+            c = &cursor_cache[i];
+    }
+    if (c->last_used)
+        XFreeCursor(d, c->cursor);
+    c->display = display;
+    c->serial = serial;
+    c->cursor = cursor;
+    c->last_used = ++cursor_cache_clock;
+    return c;
+}
+
+/* Frees the cached cursors of a display, or of all displays if -1. */
+static void cache_purge(Display *d, int display) {
+    int i;
+    for (i = 0; i < CURSOR_CACHE_SIZE; i++) {
+        struct cached_cursor *c = &cursor_cache[i];
+        if (c->last_used && (display < 0 || c->display == display)) {
+            XFreeCursor(d, c->cursor);
+            c->last_used = 0;
+        }
     }
-    /* Make sure the displays aren't equal */
-    char *cros_n = XDisplayName(NULL);
-    if (cros_n[1] == argv[1][1]) {
-        fprintf(stderr, "You must specify a different display.\n");
-        return 2;
+}
+
+/* Applies a cached cursor to the Chromium OS X11 server.
+ * Returns 1 on success, 0 if the cursor is not in the cache. */
+static int apply_cached_cursor(Display* d, Window w, int display,
+                               unsigned long serial) {
+    struct cached_cursor *c = cache_lookup(display, serial);
+    if (!c)
+        return 0;
+    XDefineCursor(d, w, c->cursor);
+    XFlush(d);
+    return 1;
+}
+
+/* Apply the cursor to the Chromium OS X11 server, or unset the current cursor
+ * if no image is passed. */
+static void apply_cursor(Display* d, Window w, int display,
+                         XFixesCursorImage *image, double scale) {
+    if (!image) {
+        XUndefineCursor(d, w);
+        XFlush(d);
+        return;
     }
+    if (apply_cached_cursor(d, w, display, image->cursor_serial))
+        return;
+    Cursor cursor = create_cursor(d, w, image, scale);
+    if (!cursor)
+        return;
+    cache_insert(d, display, image->cursor_serial, cursor);
+    XDefineCursor(d, w, cursor);
+    XFlush(d);
+}
+
+/* Mirrors the cursor of a single chroot display. */
+static int single_display(char *name) {
     /* Open the displays */
     Display *cros_d, *chroot_d;
     Window cros_w, chroot_w;
@@ -97,8 +370,8 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Failed to open Chromium OS display\n");
         return 1;
     }
-    if (!(chroot_d = XOpenDisplay(argv[1]))) {
-        fprintf(stderr, "Failed to open chroot display %s\n", argv[1]);
+    if (!(chroot_d = XOpenDisplay(name))) {
+        fprintf(stderr, "Failed to open chroot display %s\n", name);
         return 1;
     }
     /* Get the XFixes extension for the chroot to monitor the cursor */
@@ -112,6 +385,8 @@ int main(int argc, char** argv) {
     /* Get the root windows */
     cros_w = DefaultRootWindow(cros_d);
     chroot_w = DefaultRootWindow(chroot_d);
+    int number = display_number(name);
+    double scale = display_scale(cros_d, chroot_d);
     /* Monitor the chroot root window for cursor changes */
     XFixesSelectCursorInput(chroot_d, chroot_w, XFixesDisplayCursorNotifyMask);
     XEvent e;
@@ -119,14 +394,539 @@ int main(int argc, char** argv) {
         XNextEvent(chroot_d, &e);
         if (error) break;
         if (e.type != xfixes_event + XFixesCursorNotify) continue;
-        /* Grab the new cursor and apply it to the Chromium OS X11 server */
+        /* Reuse the cursor if it was seen before. Otherwise, grab the new
+         * cursor and apply it to the Chromium OS X11 server */
+        XFixesCursorNotifyEvent *ce = (XFixesCursorNotifyEvent *) &e;
+        if (apply_cached_cursor(cros_d, cros_w, number, ce->cursor_serial))
+            continue;
         XFixesCursorImage *img = XFixesGetCursorImage(chroot_d);
-        apply_cursor(cros_d, cros_w, img);
+        apply_cursor(cros_d, cros_w, number, img, scale);
         XFree(img);
     }
     /* Clean up */
-    apply_cursor(cros_d, cros_w, NULL);
+    apply_cursor(cros_d, cros_w, number, NULL, scale);
+    cache_purge(cros_d, -1);
     XCloseDisplay(cros_d);
     XCloseDisplay(chroot_d);
     return 0;
 }
+
+/* Multi-display mode */
+
+struct chroot_display {
+    Display *d;
+    int number; /* X11 display number, used to match Xephyr windows */
+    int xfixes_event;
+    double scale;
+    int failed; /* Set on X errors, to detach the display */
+};
+
+static struct chroot_display displays[MAX_DISPLAYS];
+static int ndisplays = 0;
+/* Index of the display whose cursor is mirrored, -1 if none is focused. */
+static int focused = -1;
+
+static int find_display(int number) {
+    int i;
+    for (i = 0; i < ndisplays; i++) {
+        if (displays[i].number == number)
+            return i;
+    }
+    return -1;
+}
+
+/* Changes the focused display, and applies its current cursor. */
+static void focus_display(Display *cros_d, Window cros_w, int i) {
+    focused = i;
+    if (i < 0) {
+        apply_cursor(cros_d, cros_w, -1, NULL, 1);
+        return;
+    }
+    XFixesCursorImage *img = XFixesGetCursorImage(displays[i].d);
+    apply_cursor(cros_d, cros_w, displays[i].number, img, displays[i].scale);
+    if (img)
+        XFree(img);
+}
+
+/* Starts monitoring a chroot display, and focuses it, as a newly-attached
+ * session is the one in front. Returns 0 on success. */
+static int attach_display(Display *cros_d, Window cros_w, char *name) {
+    int number = display_number(name);
+    if (number < 0 || number == display_number(XDisplayName(NULL))) {
+        fprintf(stderr, "Invalid chroot display %s\n", name);
+        return -1;
+    }
+    int i = find_display(number);
+    if (i < 0) {
+        if (ndisplays >= MAX_DISPLAYS) {
+            fprintf(stderr, "Too many displays, cannot attach %s\n", name);
+            return -1;
+        }
+        Display *d = XOpenDisplay(name);
+        if (!d) {
+            fprintf(stderr, "Failed to open chroot display %s\n", name);
+            return -1;
+        }
+        int xfixes_event, xfixes_error;
+        if (!XFixesQueryExtension(d, &xfixes_event, &xfixes_error)) {
+            fprintf(stderr, "chroot display %s is missing XFixes extension\n",
+                    name);
+            XCloseDisplay(d);
+            return -1;
+        }
+        XFixesSelectCursorInput(d, DefaultRootWindow(d),
+                                XFixesDisplayCursorNotifyMask);
+        XFlush(d);
+        i = ndisplays++;
+        displays[i].d = d;
+        displays[i].number = number;
+        displays[i].xfixes_event = xfixes_event;
+        displays[i].scale = display_scale(cros_d, d);
+        displays[i].failed = 0;
+        /* Cursor serials of a previous server with this number are stale */
+        cache_purge(cros_d, number);
+    }
+    focus_display(cros_d, cros_w, i);
+    return 0;
+}
+
+/* Stops monitoring a chroot display. If the server has already gone away,
+ * closing the display would call Xlib's fatal IO error handler: only close the
+ * socket, and leak the (small) Display structure. */
+static void detach_display(Display *cros_d, Window cros_w, int i, int alive) {
+    int number = displays[i].number;
+    if (alive)
+        XCloseDisplay(displays[i].d);
+    else
+        close(ConnectionNumber(displays[i].d));
+    displays[i] = displays[--ndisplays];
+    if (focused == i)
+        focus_display(cros_d, cros_w, -1);
+    else if (focused == ndisplays)
+        focused = i;
+    cache_purge(cros_d, number);
+}
+
+/* Returns 1 if the X11 server closed the connection. */
+static int connection_closed(int fd) {
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/* Tracks which Xephyr window is shown on the Chromium OS X11 server, using
+ * MapNotify events that do not have the override-redirect flag (the same
+ * events croutonclip uses to detect window changes). */
+static void handle_cros_event(Display *cros_d, Window cros_w) {
+    XEvent e;
+    char *wm_name = NULL;
+    int number = -1;
+
+    XNextEvent(cros_d, &e);
+    if (e.type != MapNotify || e.xmap.override_redirect)
+        return;
+
+    /* The window may be gone already: ignore errors. This relies on WM_NAME
+     * looking like "Xephyr on :1.0 (...)" */
+    ignore_errors = 1;
+    if (XFetchName(cros_d, e.xmap.window, &wm_name) && wm_name) {
+        if (sscanf(wm_name, "Xephyr on :%d", &number) != 1)
+            number = -1;
+        XFree(wm_name);
+    }
+    XSync(cros_d, False);
+    ignore_errors = 0;
+
+    int i = number >= 0 ? find_display(number) : -1;
+    if (i != focused)
+        focus_display(cros_d, cros_w, i);
+}
+
+/* Sends an attach ('a') or detach ('r') command to the running daemon.
+ * Returns 0 on success, -1 if no daemon is listening. */
+static int control_send(char cmd, char *name) {
+    char buffer[MAX_COMMAND];
+    int fd, len;
+
+    len = snprintf(buffer, sizeof(buffer), "%c:%s\n", cmd, name);
+    if (len >= sizeof(buffer)) {
+        fprintf(stderr, "Invalid chroot display %s\n", name);
+        return -1;
+    }
+
+    if ((fd = socket_connect(CONTROL_SOCKET, SOCK_STREAM)) < 0)
+        return -1;
+    if (write(fd, buffer, len) != len) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Accepts a connection on the control socket and runs its command. */
+static void control_read(int listen_fd, Display *cros_d, Window cros_w) {
+    char buffer[MAX_COMMAND];
+    int fd, n, len = 0;
+
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+        return;
+    while (len < sizeof(buffer)-1 &&
+            (n = read(fd, buffer+len, sizeof(buffer)-1-len)) > 0) {
+        len += n;
+        if (buffer[len-1] == '\n')
+            break;
+    }
+    close(fd);
+    if (len < 3 || buffer[1] != ':' || buffer[len-1] != '\n')
+        return;
+    buffer[len-1] = '\0';
+
+    if (buffer[0] == 'a') {
+        attach_display(cros_d, cros_w, buffer+2);
+    } else if (buffer[0] == 'r') {
+        int i = find_display(display_number(buffer+2));
+        if (i >= 0)
+            detach_display(cros_d, cros_w, i, 1);
+    }
+}
+
+/* Runs the commands of the connections already queued on the control socket.
+ */
+static void control_drain(int listen_fd, Display *cros_d, Window cros_w) {
+    struct pollfd fd = { .fd = listen_fd, .events = POLLIN };
+    while (poll(&fd, 1, 0) > 0 && (fd.revents & POLLIN))
+        control_read(listen_fd, cros_d, cros_w);
+}
+
+/* Display whose connection was lost, and where the event loop resumes */
+static Display *lost_display;
+static jmp_buf lost_jmp;
+
+/* An X error on a chroot display (e.g. a window or cursor that went away while
+ * its session closes) only detaches that display: only errors on the Chromium
+ * OS display are fatal. */
+static int multi_error_handler(Display *d, XErrorEvent *e) {
+    int i;
+    if (ignore_errors)
+        return 0;
+    for (i = 0; i < ndisplays; i++) {
+        if (displays[i].d == d) {
+            fprintf(stderr, "X11 error on display :%d: %d, %d, %d\n",
+                    displays[i].number,
+                    e->error_code, e->request_code, e->minor_code);
+            displays[i].failed = 1;
+            return 0;
+        }
+    }
+    return error_handler(d, e);
+}
+
+/* Detaches the chroot displays that got X errors. */
+static void detach_failed(Display *cros_d, Window cros_w) {
+    int i;
+    /* Go backwards, as detaching moves the last display to index i. */
+    for (i = ndisplays-1; i >= 0; i--) {
+        if (displays[i].failed)
+            detach_display(cros_d, cros_w, i, 1);
+    }
+}
+
+/* Xlib cannot use a display after its connection is lost, and exits if the
+ * IO error handler returns: jump back to the event loop of multi_display
+ * instead, which detaches the display. */
+static int io_error_handler(Display *d) {
+    lost_display = d;
+    longjmp(lost_jmp, 1);
+    return 0;
+}
+
+/* Mirrors the cursor of the focused display among many chroot displays, until
+ * the last one is detached. */
+static int multi_display(int count, char **names) {
+    struct pollfd fds[MAX_DISPLAYS+2];
+    Display *cros_d;
+    Window cros_w;
+    char name[16];
+    /* Modified after setjmp: must not be cached in a register */
+    volatile int listen_fd;
+    int i;
+
+    listen_fd = socket_listen(CONTROL_SOCKET, SOCK_STREAM, 8);
+    if (listen_fd == -2) {
+        /* A daemon is already running: hand the displays over to it. */
+        for (i = 0; i < count; i++) {
+            if (control_send('a', names[i]) < 0) {
+                fprintf(stderr, "Failed to attach %s\n", names[i]);
+                return 1;
+            }
+        }
+        return 0;
+    } else if (listen_fd < 0) {
+        return 1;
+    }
+
+    /* Do not get killed with the session that happened to start us. */
+    setsid();
+
+    if (!(cros_d = XOpenDisplay(NULL))) {
+        fprintf(stderr, "Failed to open Chromium OS display\n");
+        unlink(CONTROL_SOCKET);
+        return 1;
+    }
+    XSetErrorHandler(multi_error_handler);
+    cros_w = DefaultRootWindow(cros_d);
+    XSelectInput(cros_d, cros_w, SubstructureNotifyMask);
+
+    for (i = 0; i < count; i++)
+        attach_display(cros_d, cros_w, names[i]);
+
+    /* A chroot display that goes away is detached, wherever Xlib notices. */
+    if (setjmp(lost_jmp)) {
+        if (lost_display == cros_d) {
+            fprintf(stderr, "Lost the Chromium OS display\n");
+            if (listen_fd >= 0)
+                unlink(CONTROL_SOCKET);
+            exit(1);
+        }
+        for (i = 0; i < ndisplays; i++) {
+            if (displays[i].d == lost_display) {
+                detach_display(cros_d, cros_w, i, 0);
+                break;
+            }
+        }
+    }
+    XSetIOErrorHandler(io_error_handler);
+
+    while (!error) {
+        detach_failed(cros_d, cros_w);
+        if (ndisplays == 0) {
+            /* Stop listening, but first attach the displays of the commands
+             * that were already queued. */
+            unlink(CONTROL_SOCKET);
+            control_drain(listen_fd, cros_d, cros_w);
+            close(listen_fd);
+            listen_fd = -1;
+            if (ndisplays == 0)
+                break;
+            /* Listen again, or hand the displays over to a daemon that
+             * started in the meantime. */
+            listen_fd = socket_listen(CONTROL_SOCKET, SOCK_STREAM, 8);
+            if (listen_fd == -2) {
+                for (i = 0; i < ndisplays; i++) {
+                    snprintf(name, sizeof(name), ":%d", displays[i].number);
+                    control_send('a', name);
+                }
+            }
+            if (listen_fd < 0) {
+                error = listen_fd == -1;
+                break;
+            }
+        }
+
+        /* Xlib may already have queued events while waiting for replies:
+         * do not block in poll if that is the case. */
+        int timeout = XEventsQueued(cros_d, QueuedAlready) ? 0 : -1;
+        fds[0].fd = listen_fd;
+        fds[1].fd = ConnectionNumber(cros_d);
+        for (i = 0; i < ndisplays; i++) {
+            fds[i+2].fd = ConnectionNumber(displays[i].d);
+            if (XEventsQueued(displays[i].d, QueuedAlready))
+                timeout = 0;
+        }
+        for (i = 0; i < ndisplays+2; i++) {
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        int n = poll(fds, ndisplays+2, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        /* Go backwards, as detaching moves the last display to index i. */
+        for (i = ndisplays-1; i >= 0; i--) {
+            Display *d = displays[i].d;
+            if ((fds[i+2].revents & (POLLHUP | POLLERR)) ||
+                    ((fds[i+2].revents & POLLIN) &&
+                     connection_closed(ConnectionNumber(d)))) {
+                detach_display(cros_d, cros_w, i, 0);
+                continue;
+            }
+            int changed = 0;
+            unsigned long serial = 0;
+            while (!error && XPending(d)) {
+                XEvent e;
+                XNextEvent(d, &e);
+                if (e.type == displays[i].xfixes_event + XFixesCursorNotify) {
+                    changed = 1;
+                    serial = ((XFixesCursorNotifyEvent *) &e)->cursor_serial;
+                }
+            }
+            /* Only the focused display's cursor is visible. */
+            if (changed && i == focused &&
+                    !apply_cached_cursor(cros_d, cros_w, displays[i].number,
+                                         serial))
+                focus_display(cros_d, cros_w, i);
+        }
+        while (!error && XPending(cros_d))
+            handle_cros_event(cros_d, cros_w);
+        if (fds[0].revents & POLLIN)
+            control_read(listen_fd, cros_d, cros_w);
+    }
+
+    /* Clean up */
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(CONTROL_SOCKET);
+    }
+    focus_display(cros_d, cros_w, -1);
+    while (ndisplays > 0)
+        detach_display(cros_d, cros_w, ndisplays-1, 1);
+    XCloseDisplay(cros_d);
+    return error;
+}
+
+/* Microbenchmark of the cursor pixel pipeline, on synthetic cursors. */
+
+static double elapsed_ns(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+static int benchmark() {
+    static const int sizes[] = { 32, 64, 128, 256 };
+    /* Run each stage over about 64M pixels */
+    const long total = 64 << 20;
+    unsigned long *src;
+    uint32_t *dst, *scaled;
+    struct timespec start;
+    int s, i, iter;
+
+    src = malloc(MAX_CURSOR_SIZE * MAX_CURSOR_SIZE * sizeof(*src));
+    dst = malloc(MAX_CURSOR_SIZE * MAX_CURSOR_SIZE * sizeof(*dst));
+    scaled = malloc(MAX_CURSOR_SIZE * MAX_CURSOR_SIZE * sizeof(*scaled));
+    if (!src || !dst || !scaled) {
+        fprintf(stderr, "Cannot allocate benchmark buffers\n");
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < MAX_CURSOR_SIZE * MAX_CURSOR_SIZE; i++)
+        src[i] = (unsigned long) rand() << 16 ^ rand();
+
+    printf("%9s %14s %14s %14s\n", "size", "convert ns/px",
+           "clamp ns/px", "scale ns/px");
+    for (s = 0; s < sizeof(sizes)/sizeof(*sizes); s++) {
+        int size = sizes[s];
+        int n = size * size;
+        int iterations = total / n;
+        double convert, clamp, scale;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (iter = 0; iter < iterations; iter++)
+            convert_pixels(dst, src, n);
+        convert = elapsed_ns(&start) / ((double) iterations * n);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (iter = 0; iter < iterations; iter++)
+            clamp_premultiplied(dst, n);
+        clamp = elapsed_ns(&start) / ((double) iterations * n);
+
+        /* Downscale the largest cursor, upscale the others. */
+        int scaled_size = size < MAX_CURSOR_SIZE ? size * 2 : size / 2;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (iter = 0; iter < iterations; iter++)
+            scale_pixels(scaled, scaled_size, scaled_size, dst, size, size);
+        scale = elapsed_ns(&start) /
+                ((double) iterations * scaled_size * scaled_size);
+
+        printf("%4dx%-4d %14.3f %14.3f %14.3f\n",
+               size, size, convert, clamp, scale);
+    }
+    free(src);
+    free(dst);
+    free(scaled);
+    return 0;
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "Usage: %s [-s scale|auto] chrootdisplay\n", argv0);
+    fprintf(stderr, "       %s [-s scale|auto] -d chrootdisplay...\n", argv0);
+    fprintf(stderr, "       %s -a|-r chrootdisplay\n", argv0);
+    fprintf(stderr, "       %s -b\n", argv0);
+    fprintf(stderr, "   -d: mirror the cursor of the focused display, among\n"
+                    "       many displays, in a single daemon.\n");
+    fprintf(stderr, "   -a: attach a display to the running daemon.\n");
+    fprintf(stderr, "   -r: detach a display from the running daemon.\n");
+    fprintf(stderr, "   -s: scale cursors by the given factor, or to match\n"
+                    "       the DPI of the Chromium OS display (auto).\n");
+    fprintf(stderr, "   -b: benchmark the cursor pixel pipeline.\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    int mode = 0;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "adrs:b")) != -1) {
+        switch (c) {
+        case 'a':
+        case 'd':
+        case 'r':
+        case 'b':
+            if (mode)
+                usage(argv[0]);
+            mode = c;
+            break;
+        case 's':
+            if (!strcmp(optarg, "auto")) {
+                scale_factor = 0;
+            } else {
+                scale_factor = atof(optarg);
+                if (scale_factor <= 0 || scale_factor > MAX_SCALE)
+                    usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (mode == 'b') {
+        if (argc != 0)
+            usage(argv[-optind]);
+        return benchmark();
+    }
+    if (argc < 1)
+        usage(argv[-optind]);
+    /* Make sure all display names are valid */
+    for (i = 0; i < argc; i++) {
+        if (!argv[i][0] || !argv[i][1])
+            usage(argv[-optind]);
+    }
+
+    if (mode == 0) {
+        if (argc != 1)
+            usage(argv[-optind]);
+        /* Make sure the displays aren't equal */
+        if (display_number(XDisplayName(NULL)) == display_number(argv[0])) {
+            fprintf(stderr, "You must specify a different display.\n");
+            return 2;
+        }
+        return single_display(argv[0]);
+    } else if (mode == 'd') {
+        return multi_display(argc, argv);
+    } else if (argc != 1) {
+        usage(argv[-optind]);
+    }
+    if (control_send(mode, argv[0]) < 0) {
+        fprintf(stderr, "Failed to contact the croutoncursor daemon\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,703 @@
+/* Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * D-Bus bridge: holds a single connection to the host's system bus, and
+ * forwards powerd commands received on a local socket, so that scripts do not
+ * spawn dbus-send, and connect to the bus, on every call:
+ *   ping                           HandleUserActivity (rate-limited)
+ *   screen|keyboard up|down        Increase/Decrease*Brightness
+ *   screen set PERCENT [instant]   SetScreenBrightnessPercent
+ *   screen|keyboard get            Get*BrightnessPercent (replies the value)
+ *
+ * Brightness steps are coalesced: opposite steps cancel out, only one call per
+ * device is in flight, and at most MAX_STEPS steps are queued behind it, so
+ * that key autorepeat does not build up a backlog of calls.
+ *
+ * Without -d, sends a command to the daemon, or runs it directly if the
+ * daemon is not running. The bus address is read from DBUS_SYSTEM_BUS_ADDRESS
+ * (see host-dbus), so the bridge can be tested against a private dbus-daemon.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "socket.h"
+
+#define CONTROL_SOCKET "/tmp/crouton-dbus"
+#define MAX_COMMAND 64
+#define MAX_CLIENTS 16
+#define MAX_CALLS 16
+/* Maximum number of brightness steps queued behind a call in flight */
+#define MAX_STEPS 2
+/* Minimum interval between pings to powerd (ms) */
+#define PING_INTERVAL 1000
+/* Time after which a call is considered lost (ms) */
+#define CALL_TIMEOUT 2000
+
+#define DBUS_DEFAULT_ADDRESS "unix:path=/var/run/dbus/system_bus_socket"
+#define DBUS_MAX_MESSAGE 512
+#define DBUS_MAX_RECEIVE 65536
+#define DBUS_MESSAGE_METHOD_CALL 1
+#define DBUS_MESSAGE_METHOD_RETURN 2
+#define DBUS_MESSAGE_ERROR 3
+#define DBUS_FLAG_NO_REPLY_EXPECTED 0x1
+#define DBUS_HEADER_PATH 1
+#define DBUS_HEADER_INTERFACE 2
+#define DBUS_HEADER_MEMBER 3
+#define DBUS_HEADER_REPLY_SERIAL 5
+#define DBUS_HEADER_DESTINATION 6
+#define DBUS_HEADER_SIGNATURE 8
+
+#define POWERD_NAME "org.chromium.PowerManager"
+#define POWERD_PATH "/org/chromium/PowerManager"
+
+enum device { SCREEN, KEYBOARD, NDEVICES };
+static const char *device_names[] = { "Screen", "Keyboard" };
+
+static int dbus_fd = -1;
+static uint32_t dbus_serial = 0;
+/* Partially received messages */
+static unsigned char dbus_buffer[DBUS_MAX_RECEIVE];
+static int dbus_buffer_len = 0;
+
+/* Calls waiting for a reply */
+static struct call {
+    uint32_t serial; /* 0 if the slot is free */
+    int client; /* Client to reply to, or -1 */
+    int device; /* Device whose step is in flight, or -1 */
+    double sent;
+} calls[MAX_CALLS];
+
+/* Brightness steps waiting to be sent (positive: up), and whether a step call
+ * is in flight, per device. */
+static int steps[NDEVICES];
+static int inflight[NDEVICES];
+static double last_ping = -PING_INTERVAL;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+/* Minimal D-Bus protocol implementation: method calls with simple arguments,
+ * and replies with at most a double. */
+
+struct dbus_message {
+    unsigned char data[DBUS_MAX_MESSAGE];
+    int len;
+};
+
+static void dbus_align(struct dbus_message *m, int n) {
+    while (m->len % n)
+        m->data[m->len++] = 0;
+}
+
+static void dbus_byte(struct dbus_message *m, uint8_t v) {
+    m->data[m->len++] = v;
+}
+
+/* Integers are sent in native byte order, which the first header byte
+ * specifies. */
+static void dbus_uint32(struct dbus_message *m, uint32_t v) {
+    dbus_align(m, 4);
+    memcpy(m->data+m->len, &v, 4);
+    m->len += 4;
+}
+
+static void dbus_double(struct dbus_message *m, double v) {
+    dbus_align(m, 8);
+    memcpy(m->data+m->len, &v, 8);
+    m->len += 8;
+}
+
+/* Appends a string or object path. */
+static void dbus_string(struct dbus_message *m, const char *s) {
+    int n = strlen(s);
+    dbus_uint32(m, n);
+    memcpy(m->data+m->len, s, n+1);
+    m->len += n+1;
+}
+
+/* Appends a header field with a string or object path (type 's' or 'o'), or
+ * a signature (type 'g'). */
+static void dbus_field(struct dbus_message *m, int code, char type,
+                       const char *value) {
+    dbus_align(m, 8);
+    dbus_byte(m, code);
+    /* Variant signature */
+    dbus_byte(m, 1);
+    dbus_byte(m, type);
+    dbus_byte(m, 0);
+    if (type == 'g') {
+        dbus_byte(m, strlen(value));
+        memcpy(m->data+m->len, value, strlen(value)+1);
+        m->len += strlen(value)+1;
+    } else {
+        dbus_string(m, value);
+    }
+}
+
+/* Sends a method call. signature may contain 'd' (double) and 'i' (int32)
+ * arguments, whose values are passed in args. Returns the serial of the
+ * call, or 0 on error. */
+static uint32_t dbus_call(const char *dest, const char *path,
+                          const char *iface, const char *member, int flags,
+                          const char *signature, const double *args) {
+    struct dbus_message m;
+    const uint16_t endian = 1;
+    int i;
+
+    m.len = 0;
+    dbus_byte(&m, *(const uint8_t *) &endian ? 'l' : 'B');
+    dbus_byte(&m, DBUS_MESSAGE_METHOD_CALL);
+    dbus_byte(&m, flags);
+    dbus_byte(&m, 1); /* Protocol version */
+    int body_length_pos = m.len;
+    dbus_uint32(&m, 0);
+    dbus_uint32(&m, ++dbus_serial);
+    /* Header fields array: length, then the fields, aligned to 8 bytes */
+    int length_pos = m.len;
+    dbus_uint32(&m, 0);
+    dbus_align(&m, 8);
+    int start = m.len;
+    dbus_field(&m, DBUS_HEADER_PATH, 'o', path);
+    if (iface)
+        dbus_field(&m, DBUS_HEADER_INTERFACE, 's', iface);
+    dbus_field(&m, DBUS_HEADER_MEMBER, 's', member);
+    dbus_field(&m, DBUS_HEADER_DESTINATION, 's', dest);
+    if (signature && *signature)
+        dbus_field(&m, DBUS_HEADER_SIGNATURE, 'g', signature);
+    uint32_t length = m.len - start;
+    memcpy(m.data+length_pos, &length, 4);
+    /* The body starts on an 8-byte boundary */
+    dbus_align(&m, 8);
+    start = m.len;
+    for (i = 0; signature && signature[i]; i++) {
+        if (signature[i] == 'd')
+            dbus_double(&m, args[i]);
+        else
+            dbus_uint32(&m, (int32_t) args[i]);
+    }
+    length = m.len - start;
+    memcpy(m.data+body_length_pos, &length, 4);
+
+    if (send(dbus_fd, m.data, m.len, MSG_NOSIGNAL) != m.len)
+        return 0;
+    return dbus_serial;
+}
+
+static void reply(int client, const char *str);
+
+/* Closes the bus connection, failing all calls in flight. */
+static void dbus_close() {
+    int i;
+
+    if (dbus_fd >= 0)
+        close(dbus_fd);
+    dbus_fd = -1;
+    dbus_buffer_len = 0;
+    for (i = 0; i < MAX_CALLS; i++) {
+        if (calls[i].serial) {
+            reply(calls[i].client, "error");
+            calls[i].serial = 0;
+        }
+    }
+    for (i = 0; i < NDEVICES; i++)
+        inflight[i] = 0;
+}
+
+/* Connects and authenticates to the system bus (DBUS_SYSTEM_BUS_ADDRESS, as
+ * set by host-dbus), and registers with the bus. Returns 0 on success. */
+static int dbus_connect() {
+    const char *address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+    struct sockaddr_un addr;
+    char buffer[256];
+    char uid[16];
+    int i, n, len;
+
+    if (!address)
+        address = DBUS_DEFAULT_ADDRESS;
+    if (strncmp(address, "unix:path=", 10) ||
+            strcspn(address+10, ",;") >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unsupported D-Bus address %s\n", address);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, address+10, strcspn(address+10, ",;"));
+
+    if ((dbus_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+            connect(dbus_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror("Cannot connect to D-Bus");
+        dbus_close();
+        return -1;
+    }
+
+    /* Authenticate with the uid, hex-encoded */
+    snprintf(uid, sizeof(uid), "%u", (unsigned int) getuid());
+    len = snprintf(buffer, sizeof(buffer), "%cAUTH EXTERNAL ", '\0');
+    for (i = 0; uid[i]; i++)
+        len += snprintf(buffer+len, sizeof(buffer)-len, "%02x", uid[i]);
+    len += snprintf(buffer+len, sizeof(buffer)-len, "\r\n");
+    if (write(dbus_fd, buffer, len) != len)
+        goto error;
+    len = 0;
+    while (len < sizeof(buffer)-1 && (len < 2 || buffer[len-1] != '\n')) {
+        if ((n = read(dbus_fd, buffer+len, sizeof(buffer)-1-len)) <= 0)
+            goto error;
+        len += n;
+    }
+    if (strncmp(buffer, "OK ", 3)) {
+        buffer[len] = '\0';
+        fprintf(stderr, "D-Bus authentication failed: %s", buffer);
+        goto error;
+    }
+    if (write(dbus_fd, "BEGIN\r\n", 7) != 7)
+        goto error;
+
+    /* The first message must be Hello. Its reply is ignored. */
+    if (!dbus_call("org.freedesktop.DBus", "/org/freedesktop/DBus",
+                   "org.freedesktop.DBus", "Hello", 0, NULL, NULL))
+        goto error;
+    return 0;
+
+error:
+    fprintf(stderr, "D-Bus connection failed.\n");
+    dbus_close();
+    return -1;
+}
+
+/* Returns 1 if message m is in native byte order. */
+static int dbus_native(const unsigned char *m) {
+    const uint16_t endian = 1;
+    return (m[0] == 'l') == (*(const uint8_t *) &endian == 1);
+}
+
+/* Reads a uint32 in the byte order of message m. */
+static uint32_t dbus_get32(const unsigned char *m, int pos) {
+    uint32_t v;
+    memcpy(&v, m+pos, 4);
+    return dbus_native(m) ? v : __builtin_bswap32(v);
+}
+
+/* Parses the header fields of a complete message, returning the reply serial
+ * (0 if none). */
+static uint32_t dbus_reply_serial(const unsigned char *m, int fields_len) {
+    int pos = 16;
+    int end = 16 + fields_len;
+
+    while (pos < end) {
+        int code = m[pos];
+        int siglen = m[pos+1];
+        char type = m[pos+2];
+        pos += 2 + siglen + 1;
+        switch (type) {
+        case 'u':
+            pos = (pos+3) & ~3;
+            if (code == DBUS_HEADER_REPLY_SERIAL)
+                return dbus_get32(m, pos);
+            pos += 4;
+            break;
+        case 's':
+        case 'o':
+            pos = (pos+3) & ~3;
+            pos += 4 + dbus_get32(m, pos) + 1;
+            break;
+        case 'g':
+            pos += 1 + m[pos] + 1;
+            break;
+        default:
+            /* Not used by the bus in header fields */
+            return 0;
+        }
+        pos = (pos+7) & ~7;
+    }
+    return 0;
+}
+
+static void send_step(int device);
+
+/* Handles a complete message: replies to the client of the matching call. */
+static void dbus_message(const unsigned char *m, int header_len,
+                         int body_len) {
+    uint32_t serial;
+    char str[32];
+    int i;
+
+    if (m[1] != DBUS_MESSAGE_METHOD_RETURN && m[1] != DBUS_MESSAGE_ERROR)
+        return;
+    if (!(serial = dbus_reply_serial(m, dbus_get32(m, 12))))
+        return;
+
+    for (i = 0; i < MAX_CALLS; i++) {
+        struct call *call = &calls[i];
+        if (call->serial != serial)
+            continue;
+        if (m[1] == DBUS_MESSAGE_ERROR) {
+            reply(call->client, "error");
+        } else if (body_len >= 8) {
+            double value;
+            memcpy(&value, m+header_len, 8);
+            if (!dbus_native(m)) {
+                uint64_t v;
+                memcpy(&v, &value, 8);
+                v = __builtin_bswap64(v);
+                memcpy(&value, &v, 8);
+            }
+            snprintf(str, sizeof(str), "%d", (int) value);
+            reply(call->client, str);
+        } else {
+            reply(call->client, "ok");
+        }
+        call->serial = 0;
+        if (call->device >= 0) {
+            inflight[call->device] = 0;
+            send_step(call->device);
+        }
+        return;
+    }
+}
+
+/* Reads from the bus, and handles complete messages. */
+static void dbus_read() {
+    int n, pos = 0;
+
+    n = recv(dbus_fd, dbus_buffer+dbus_buffer_len,
+             sizeof(dbus_buffer)-dbus_buffer_len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        dbus_close();
+        return;
+    }
+    if (n < 0)
+        return;
+    dbus_buffer_len += n;
+
+    while (dbus_buffer_len - pos >= 16) {
+        unsigned char *m = dbus_buffer+pos;
+        int header_len = (16 + dbus_get32(m, 12) + 7) & ~7;
+        int total = header_len + dbus_get32(m, 4);
+        if (total > sizeof(dbus_buffer)) {
+            fprintf(stderr, "D-Bus message too large.\n");
+            dbus_close();
+            return;
+        }
+        if (dbus_buffer_len - pos < total)
+            break;
+        dbus_message(m, header_len, total - header_len);
+        pos += total;
+    }
+    memmove(dbus_buffer, dbus_buffer+pos, dbus_buffer_len-pos);
+    dbus_buffer_len -= pos;
+}
+
+/* Calls a powerd method, connecting to the bus if needed. The reply goes to
+ * client if it is not -1. Returns 0 on success. */
+static int powerd_call(const char *member, int client, int device,
+                       const char *signature, const double *args) {
+    int i, slot = -1;
+    uint32_t serial;
+
+    if (dbus_fd < 0 && dbus_connect() < 0)
+        return -1;
+    if (client >= 0 || device >= 0) {
+        for (i = 0; i < MAX_CALLS && slot < 0; i++) {
+            if (!calls[i].serial)
+                slot = i;
+        }
+        if (slot < 0) {
+            fprintf(stderr, "Too many calls in flight.\n");
+            return -1;
+        }
+    }
+    serial = dbus_call(POWERD_NAME, POWERD_PATH, POWERD_NAME, member,
+                       slot < 0 ? DBUS_FLAG_NO_REPLY_EXPECTED : 0,
+                       signature, args);
+    if (!serial) {
+        dbus_close();
+        return -1;
+    }
+    if (slot >= 0) {
+        calls[slot].serial = serial;
+        calls[slot].client = client;
+        calls[slot].device = device;
+        calls[slot].sent = now_ms();
+    }
+    return 0;
+}
+
+/* Sends the next queued brightness step of a device, unless one is already in
+ * flight. */
+static void send_step(int device) {
+    char member[64];
+
+    if (inflight[device] || !steps[device])
+        return;
+    snprintf(member, sizeof(member), "%s%sBrightness",
+             steps[device] > 0 ? "Increase" : "Decrease",
+             device_names[device]);
+    steps[device] += steps[device] > 0 ? -1 : 1;
+    if (powerd_call(member, -1, device, NULL, NULL) == 0)
+        inflight[device] = 1;
+    else
+        steps[device] = 0;
+}
+
+/* Fails calls that did not get a reply in time, and returns the time until
+ * the next one expires (ms), or -1 if there is none. */
+static int expire_calls() {
+    double now = now_ms();
+    int i, timeout = -1;
+
+    for (i = 0; i < MAX_CALLS; i++) {
+        struct call *call = &calls[i];
+        if (!call->serial)
+            continue;
+        if (now >= call->sent + CALL_TIMEOUT) {
+            reply(call->client, "error");
+            call->serial = 0;
+            if (call->device >= 0) {
+                inflight[call->device] = 0;
+                send_step(call->device);
+            }
+        } else if (timeout < 0 || call->sent + CALL_TIMEOUT - now < timeout) {
+            timeout = call->sent + CALL_TIMEOUT - now + 1;
+        }
+    }
+    return timeout;
+}
+
+/* Sends a reply to a client (a single packet), if any. */
+static void reply(int client, const char *str) {
+    if (client >= 0)
+        send(client, str, strlen(str), MSG_NOSIGNAL);
+}
+
+/* Handles a command from a client. Commands that do not return a value are
+ * acknowledged right away, as they are coalesced. */
+static void command(int client, char *cmd) {
+    char *argv[4];
+    int argc = 0;
+    int device;
+    double args[2];
+
+    while (argc < 4 && (argv[argc] = strtok(argc ? NULL : cmd, " \n")))
+        argc++;
+    if (argc == 0) {
+        reply(client, "error");
+        return;
+    }
+
+    if (!strcmp(argv[0], "ping") && argc == 1) {
+        double now = now_ms();
+        if (now >= last_ping + PING_INTERVAL) {
+            if (powerd_call("HandleUserActivity", -1, -1, NULL, NULL) < 0) {
+                reply(client, "error");
+                return;
+            }
+            last_ping = now;
+        }
+        reply(client, "ok");
+        return;
+    }
+
+    if (!strcmp(argv[0], "screen"))
+        device = SCREEN;
+    else if (!strcmp(argv[0], "keyboard"))
+        device = KEYBOARD;
+    else
+        device = -1;
+
+    if (device < 0 || argc < 2) {
+        reply(client, "error");
+    } else if ((!strcmp(argv[1], "up") || !strcmp(argv[1], "down")) &&
+               argc == 2) {
+        steps[device] += argv[1][0] == 'u' ? 1 : -1;
+        if (steps[device] > MAX_STEPS)
+            steps[device] = MAX_STEPS;
+        else if (steps[device] < -MAX_STEPS)
+            steps[device] = -MAX_STEPS;
+        send_step(device);
+        reply(client, dbus_fd >= 0 ? "ok" : "error");
+    } else if (!strcmp(argv[1], "get") && argc == 2) {
+        char member[64];
+        snprintf(member, sizeof(member), "Get%sBrightnessPercent",
+                 device_names[device]);
+        if (powerd_call(member, client, -1, NULL, NULL) < 0)
+            reply(client, "error");
+    } else if (!strcmp(argv[1], "set") && device == SCREEN &&
+               argc >= 3 && (argc == 3 || !strcmp(argv[3], "instant"))) {
+        /* Transition: 1 is gradual, 2 is instant */
+        args[0] = atof(argv[2]);
+        args[1] = argc == 4 ? 2 : 1;
+        /* The new value overrides queued steps */
+        steps[device] = 0;
+        if (powerd_call("SetScreenBrightnessPercent", -1, -1, "di", args) < 0)
+            reply(client, "error");
+        else
+            reply(client, "ok");
+    } else {
+        reply(client, "error");
+    }
+}
+
+/* Polls the bus, the control socket, and its clients. */
+static void event_loop(int listen_fd) {
+    struct pollfd fds[2+MAX_CLIENTS];
+    int clients[MAX_CLIENTS];
+    int nclients = 0;
+    char buffer[MAX_COMMAND];
+    int i, n;
+
+    while (1) {
+        int timeout = expire_calls();
+
+        fds[0].fd = dbus_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = listen_fd;
+        fds[1].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            fds[2+i].fd = clients[i];
+            fds[2+i].events = POLLIN;
+        }
+
+        if (poll(fds, 2+nclients, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll error.");
+            return;
+        }
+
+        if (fds[0].revents)
+            dbus_read();
+
+        if (fds[1].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0 && nclients < MAX_CLIENTS)
+                clients[nclients++] = fd;
+            else if (fd >= 0)
+                close(fd);
+        }
+
+        for (i = nclients-1; i >= 0; i--) {
+            if (!fds[2+i].revents)
+                continue;
+            n = recv(clients[i], buffer, sizeof(buffer)-1, 0);
+            if (n > 0) {
+                buffer[n] = '\0';
+                command(clients[i], buffer);
+                continue;
+            }
+            /* Forget about the client in pending calls */
+            for (n = 0; n < MAX_CALLS; n++) {
+                if (calls[n].serial && calls[n].client == clients[i])
+                    calls[n].client = -1;
+            }
+            close(clients[i]);
+            clients[i] = clients[--nclients];
+        }
+    }
+}
+
+/* Runs a command directly, when the daemon is not running. Returns 0 on
+ * success. */
+static int direct_command(char *cmd) {
+    int sv[2];
+    char buffer[MAX_COMMAND];
+    int n;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    command(sv[0], cmd);
+    /* Handle bus messages until the reply comes in */
+    while ((n = recv(sv[1], buffer, sizeof(buffer)-1, MSG_DONTWAIT)) < 0) {
+        struct pollfd fds[2] = { { .fd = sv[1], .events = POLLIN },
+                                 { .fd = dbus_fd, .events = POLLIN } };
+        if (dbus_fd < 0 || poll(fds, 2, CALL_TIMEOUT) <= 0) {
+            fprintf(stderr, "No reply from powerd.\n");
+            return 1;
+        }
+        if (fds[1].revents)
+            dbus_read();
+    }
+    buffer[n] = '\0';
+    printf("%s\n", buffer);
+    return strcmp(buffer, "error") ? 0 : 1;
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "%s -d\n", argv0);
+    fprintf(stderr, "%s ping|screen|keyboard ...\n", argv0);
+    fprintf(stderr, "   Forwards powerd commands to the host's system bus, over a"
+                    " persistent\n   connection.\n");
+    fprintf(stderr, "   -d: run the daemon.\n");
+    fprintf(stderr, "   Commands:\n");
+    fprintf(stderr, "      ping: tell powerd that the user is active.\n");
+    fprintf(stderr, "      screen|keyboard up|down|get: change/print the "
+                    "brightness.\n");
+    fprintf(stderr, "      screen set PERCENT [instant]: set the brightness."
+                    "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    char cmd[MAX_COMMAND];
+    char buffer[MAX_COMMAND];
+    int daemon = 0;
+    int fd, c, i, n, len;
+
+    while ((c = getopt(argc, argv, "d")) != -1) {
+        switch (c) {
+        case 'd': daemon = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (daemon) {
+        if (optind < argc)
+            usage(argv[0]);
+        if ((fd = socket_listen(CONTROL_SOCKET, SOCK_SEQPACKET,
+                                MAX_CLIENTS)) == -2) {
+            fprintf(stderr, "The D-Bus bridge is already running.\n");
+            return 0;
+        } else if (fd < 0) {
+            return 1;
+        }
+        /* Connect right away, so that the first command is fast */
+        dbus_connect();
+        event_loop(fd);
+        return 1;
+    }
+
+    if (optind >= argc)
+        usage(argv[0]);
+    len = 0;
+    for (i = optind; i < argc; i++) {
+        len += snprintf(cmd+len, sizeof(cmd)-len, i > optind ? " %s" : "%s",
+                        argv[i]);
+        if (len >= sizeof(cmd))
+            usage(argv[0]);
+    }
+
+    if ((fd = socket_connect(CONTROL_SOCKET, SOCK_SEQPACKET)) < 0)
+        return direct_command(cmd);
+    if (send(fd, cmd, len, MSG_NOSIGNAL) != len ||
+            (n = recv(fd, buffer, sizeof(buffer)-1, 0)) <= 0) {
+        fprintf(stderr, "No reply from the D-Bus bridge.\n");
+        return 1;
+    }
+    buffer[n] = '\0';
+    printf("%s\n", buffer);
+    return strcmp(buffer, "error") ? 0 : 1;
+}
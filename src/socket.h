@@ -0,0 +1,80 @@
+/* Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Unix socket helpers shared by the daemons and their clients: each daemon
+ * listens on a socket in /tmp, replacing a stale socket left by a daemon that
+ * died, unless another instance is still listening on it.
+ *
+ * Local headers are inlined into the source when it is compiled in the chroot
+ * (see targets/common), so this only contains static functions.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Fills addr with the address of the socket at path. */
+static void socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path, path, sizeof(addr->sun_path)-1);
+}
+
+/* Connects to the socket of type (SOCK_STREAM or SOCK_SEQPACKET) at path.
+ * Returns the connected socket, or -1 if nothing is listening on it. */
+static int socket_connect(const char *path, int type) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, type, 0)) < 0)
+        return -1;
+    socket_address(path, &addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Creates a socket of type at path, and listens on it. Returns the listening
+ * socket, -2 if another process is already listening on path, or -1 on error.
+ * A stale socket is replaced. */
+static int socket_listen(const char *path, int type, int backlog) {
+    struct sockaddr_un addr;
+    int fd, test_fd;
+
+    if ((fd = socket(AF_UNIX, type, 0)) < 0) {
+        perror("socket");
+        return -1;
+    }
+    socket_address(path, &addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        if (errno != EADDRINUSE) {
+            fprintf(stderr, "Cannot bind %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if ((test_fd = socket_connect(path, type)) >= 0) {
+            close(test_fd);
+            close(fd);
+            return -2;
+        }
+        unlink(path);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Cannot bind %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, backlog) < 0) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
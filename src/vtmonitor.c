@@ -2,26 +2,229 @@
  * Use of this source code is governed by a BSD-style license that can be
  * found in the LICENSE file.
  *
- * Monitors changes in virtual terminal (VT). This is done by opening
- * /sys/class/tty/tty0/active, and waiting for POLLPRI event. Then, we
- * seek to the beginning of the file, read its content (which looks
- * like ttyX), and start polling again.
+ * Monitors session switches, and outputs the X11 display that comes to front,
+ * one per line (e.g. ":1", or ":0" for Chromium OS).
+ *
+ * By default, monitors changes in virtual terminal (VT). This is done by
+ * opening /sys/class/tty/tty0/active, and waiting for POLLPRI event. Then, we
+ * seek to the beginning of the file, read its content (which looks like ttyX),
+ * and start polling again. The VT is translated into the display of the X
+ * server that runs on it, using a cache of the X server lock files: each of
+ * them holds the pid of a server, whose controlling terminal is its VT. The
+ * cache is updated when lock files are created or deleted (inotify), and
+ * rescanned when a VT is missing from it: a server creates its lock file
+ * before it opens its VT.
+ *
+ * With -x, reads the windows mapped on Chromium OS's X server (in Xephyr mode)
+ * from the event hub's output on stdin (croutonxi2event -S -t '' -M), so that
+ * it does not need a connection of its own. Xephyr windows (named
+ * "Xephyr on :N...") are translated into their display. The aura root window
+ * is Chromium OS itself.
+ *
+ * With -t, outputs the VT itself (ttyX), without translating it.
+ *
+ * With -d, runs the VT switch daemon, which switches between the VTs of the X
+ * servers (and Chromium OS) on request of clients (-c), so that croutoncycle
+ * does not have to find them and run chvt on every key press.
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <linux/kd.h>
+#include <linux/vt.h>
 #include <poll.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "socket.h"
+
 #define SYSFILE "/sys/class/tty/tty0/active"
+#define LOCKDIR "/tmp"
 
-int main(int argc, char **argv) {
-    int fd;
-    struct pollfd fds[1];
+/* Chromium OS runs on tty1, and its X server is :0 */
+#define CROS_TTY 1
+#define CROS_DISPLAY 0
+
+/* Maximum number of X servers that are cached */
+#define MAX_SERVERS 16
+
+/* X servers, from their lock files */
+static struct server {
+    int display;
+    int tty; /* VT number */
+} servers[MAX_SERVERS];
+static int nservers = 0;
+
+/* Parses a lock file name (.X<display>-lock). Returns the display number, or
+ * -1 if this is not a lock file. */
+static int lock_display(const char *name) {
+    int display, n = 0;
+    if (sscanf(name, ".X%d-lock%n", &display, &n) != 1 || name[n] != '\0')
+        return -1;
+    return display;
+}
+
+/* Returns the VT that is the controlling terminal of a process, or -1. If
+ * comm is not NULL, it is filled with the command name of the process. */
+static int process_tty(long pid, char *comm, int size) {
+    char path[64], buffer[512];
+    char *p;
+    int fd, n, tty_nr;
+
+    /* tty_nr is the 7th field of /proc/pid/stat, and the 5th after the
+     * command name, which is in parentheses and may contain spaces. */
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buffer[n] = '\0';
+    if (!(p = strrchr(buffer, ')')) ||
+            sscanf(p+1, " %*c %*d %*d %*d %d", &tty_nr) != 1)
+        return -1;
+    if (comm) {
+        *p = '\0';
+        snprintf(comm, size, "%s", (p = strchr(buffer, '(')) ? p+1 : "");
+    }
+    /* VTs are character devices with major 4, minors 1 to 63 */
+    if ((tty_nr >> 8) != 4 || (tty_nr & 0xff) < 1 || (tty_nr & 0xff) > 63)
+        return -1;
+    return tty_nr & 0xff;
+}
+
+/* Returns the VT that is the controlling terminal of the server owning the
+ * lock file of a display, or -1. */
+static int server_tty(int display) {
+    char path[64], buffer[64];
+    int fd, n;
+    long pid;
+
+    snprintf(path, sizeof(path), LOCKDIR "/.X%d-lock", display);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    n = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buffer[n] = '\0';
+    pid = strtol(buffer, NULL, 10);
+    if (pid <= 0)
+        return -1;
+    return process_tty(pid, NULL, 0);
+}
+
+/* Updates the cache entry of a display, after its lock file changed. */
+static void server_update(int display) {
+    int i;
+    for (i = 0; i < nservers && servers[i].display != display; i++) {}
+    int tty = server_tty(display);
+    if (tty < 0) {
+        /* Lock file deleted (or server gone) */
+        if (i < nservers)
+            servers[i] = servers[--nservers];
+        return;
+    }
+    if (i == nservers) {
+        if (nservers == MAX_SERVERS)
+            return;
+        nservers++;
+    }
+    servers[i].display = display;
+    servers[i].tty = tty;
+}
+
+/* Fills the cache from all the lock files. */
+static void server_scan() {
+    DIR *dir = opendir(LOCKDIR);
+    struct dirent *entry;
+    int display;
+
+    nservers = 0;
+    if (!dir)
+        return;
+    while ((entry = readdir(dir))) {
+        if ((display = lock_display(entry->d_name)) >= 0)
+            server_update(display);
+    }
+    closedir(dir);
+}
+
+/* Applies the lock file creations and deletions reported by inotify. */
+static void server_inotify(int fd) {
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    int display, n;
+    char *p;
+
+    if ((n = read(fd, buffer, sizeof(buffer))) <= 0)
+        return;
+    for (p = buffer; p < buffer + n; p += sizeof(*event) + event->len) {
+        event = (struct inotify_event *) p;
+        if (event->mask & IN_Q_OVERFLOW)
+            server_scan();
+        else if (event->len && (display = lock_display(event->name)) >= 0)
+            server_update(display);
+    }
+}
+
+/* Returns the display running on a VT, or -1. */
+static int tty_display(int tty) {
+    int i, retry;
+    if (tty == CROS_TTY)
+        return CROS_DISPLAY;
+    for (retry = 0; retry < 2; retry++) {
+        for (i = 0; i < nservers; i++) {
+            if (servers[i].tty == tty)
+                return servers[i].display;
+        }
+        /* The server may not have had its VT when its lock file appeared */
+        if (retry == 0)
+            server_scan();
+    }
+    return -1;
+}
+
+/* Outputs a display, if it is known. */
+static void output_display(int display) {
+    if (display >= 0) {
+        printf(":%d\n", display);
+        fflush(stdout);
+    }
+}
+
+/* Seeks back to beginning of the sysfs file and reads the tty number. Returns
+ * the active VT, or -1 on error. */
+static int read_active(int fd) {
     char buffer[16];
+    int n;
+
+    lseek(fd, 0, SEEK_SET);
+    n = read(fd, buffer, sizeof(buffer)-1);
+    if (n <= 0) {
+        perror("Cannot read from " SYSFILE " file.");
+        return -1;
+    }
+    buffer[n] = '\0';
+    /* The content looks like ttyX */
+    return atoi(buffer + strcspn(buffer, "0123456789"));
+}
+
+/* Monitors VT changes, outputting the display (or the tty if raw is set). */
+static int monitor_vt(int raw) {
+    int fd, ifd = -1;
+    struct pollfd fds[2];
 
     fd = open(SYSFILE, O_RDONLY);
 
@@ -34,27 +237,44 @@ int main(int argc, char **argv) {
     fds[0].fd = fd;
     fds[0].events = POLLPRI;
 
+    if (!raw) {
+        /* Watch lock files before reading them, not to miss any update */
+        ifd = inotify_init();
+        if (ifd < 0 || inotify_add_watch(ifd, LOCKDIR,
+                           IN_CREATE | IN_DELETE | IN_MOVED_TO |
+                           IN_MOVED_FROM) < 0) {
+            perror("Cannot watch " LOCKDIR);
+            return 1;
+        }
+        fds[1].fd = ifd;
+        fds[1].events = POLLIN;
+        server_scan();
+    }
+
     while (1) {
         /* Wait for events */
-        int n = poll(fds, 1, -1);
+        int n = poll(fds, raw ? 1 : 2, -1);
         if (n <= 0) {
             perror("poll error.");
             return 1;
         }
 
+        if (fds[1].revents & POLLIN)
+            server_inotify(ifd);
+
         if (fds[0].revents & POLLPRI) {
-            /* Seek back to beginning of file and read the tty number. */
-            lseek(fd, 0, SEEK_SET);
-            n = read(fd, buffer, 16);
-            if (n <= 0) {
-                perror("Cannot read from " SYSFILE " file.");
+            int tty = read_active(fd);
+            if (tty < 0)
                 return 1;
-            }
 
-            /* Write tty number to stdout */
-            fwrite(buffer, n, 1, stdout);
-            fflush(stdout);
-        } else {
+            if (raw) {
+                /* Write tty number to stdout */
+                printf("tty%d\n", tty);
+                fflush(stdout);
+            } else {
+                output_display(tty_display(tty));
+            }
+        } else if (fds[0].revents) {
             fprintf(stderr, "Unknown poll event.\n");
             return 1;
         }
@@ -62,3 +282,345 @@ int main(int argc, char **argv) {
 
     return 0;
 }
+
+/* Reads the windows mapped on Chromium OS's X server from stdin, as reported
+ * by the event hub (croutonxi2event -S -t '' -M), and outputs the display of
+ * the Xephyr windows that come to front. */
+static int monitor_xephyr() {
+    char line[512];
+    int override, n, display;
+
+    while (fgets(line, sizeof(line), stdin)) {
+        /* MAP window <id> override <0|1> name <name> */
+        n = -1;
+        if (sscanf(line, "MAP window %*x override %d name %n",
+                   &override, &n) != 1 || n < 0 || override)
+            continue;
+        /* The name looks like "Xephyr on :1.0 (ctrl+shift grabs ...)" */
+        if (strstr(line + n, "aura_root"))
+            display = CROS_DISPLAY;
+        else if (sscanf(line + n, "Xephyr on :%d", &display) != 1)
+            continue;
+        output_display(display);
+    }
+    fprintf(stderr, "End of the window events\n");
+    return 1;
+}
+
+/* VT switch daemon: keeps the list of the VTs of the running X servers, and
+ * switches between them on request from clients (croutoncycle), with a single
+ * ioctl. The list is refreshed when the active VT changes, as X servers switch
+ * to their VT when they start, and away from it when they exit. */
+
+#define CONTROL_SOCKET "/tmp/crouton-vtmonitor"
+#define MAX_COMMAND 16
+#define MAX_TTYS 64
+#define MAX_PENDING 8
+/* How long a client waits for its VT to become active, in ms */
+#define SWITCH_TIMEOUT 2000
+
+/* Sorted VTs of the X servers, including Chromium OS */
+static int ttys[MAX_TTYS];
+static int nttys = 0;
+
+/* Clients waiting for a switch */
+static struct pending {
+    int fd;
+    int tty;
+    double deadline;
+} pending[MAX_PENDING];
+static int npending = 0;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int compare_int(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Finds the VTs of the X servers (processes named X or Xorg), like
+ * ps -CX -CXorg -otname=, without spawning it. */
+static void scan_ttys() {
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    char comm[16];
+    int i, tty;
+
+    nttys = 0;
+    ttys[nttys++] = CROS_TTY;
+    if (!dir)
+        return;
+    while ((entry = readdir(dir)) && nttys < MAX_TTYS) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+        if ((tty = process_tty(atol(entry->d_name), comm, sizeof(comm))) < 0 ||
+                (strcmp(comm, "X") && strcmp(comm, "Xorg")))
+            continue;
+        for (i = 0; i < nttys && ttys[i] != tty; i++) {}
+        if (i == nttys)
+            ttys[nttys++] = tty;
+    }
+    closedir(dir);
+    qsort(ttys, nttys, sizeof(int), compare_int);
+}
+
+/* Returns the VT to switch to from the active one, for a command (next, prev
+ * or cros), or -1 if the command is unknown. */
+static int switch_target(const char *cmd, int active) {
+    int i;
+
+    if (!strcmp(cmd, "cros"))
+        return CROS_TTY;
+    if (!strcmp(cmd, "next")) {
+        for (i = 0; i < nttys; i++) {
+            if (ttys[i] > active)
+                return ttys[i];
+        }
+        return ttys[0];
+    }
+    if (!strcmp(cmd, "prev")) {
+        for (i = nttys-1; i >= 0; i--) {
+            if (ttys[i] < active)
+                return ttys[i];
+        }
+        return ttys[nttys-1];
+    }
+    return -1;
+}
+
+/* Opens a file descriptor on which VT ioctls can be done, like chvt. */
+static int open_console() {
+    static const char *names[] = { "/dev/tty0", "/dev/tty", "/dev/console" };
+    char type;
+    int i, fd;
+
+    for (i = 0; i < sizeof(names)/sizeof(*names); i++) {
+        if ((fd = open(names[i], O_RDWR)) < 0 &&
+                (fd = open(names[i], O_RDONLY)) < 0)
+            continue;
+        if (ioctl(fd, KDGKBTYPE, &type) == 0)
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+/* Replies to a client, with the VT that is active, or an error. */
+static void reply(int fd, int tty) {
+    char buffer[MAX_COMMAND];
+    int n = tty > 0 ? snprintf(buffer, sizeof(buffer), "tty%d\n", tty)
+                    : snprintf(buffer, sizeof(buffer), "error\n");
+    send(fd, buffer, n, MSG_NOSIGNAL);
+    close(fd);
+}
+
+/* Replies to the clients waiting for a VT that is now active, or for too
+ * long. Returns the time until the next deadline in ms, or -1. */
+static int reply_pending(int active) {
+    double now = now_ms();
+    int i, timeout = -1;
+
+    for (i = npending-1; i >= 0; i--) {
+        if (pending[i].tty == active || now >= pending[i].deadline) {
+            reply(pending[i].fd, pending[i].tty == active ? active : -1);
+            pending[i] = pending[--npending];
+        } else if (timeout < 0 || pending[i].deadline - now + 1 < timeout) {
+            timeout = pending[i].deadline - now + 1;
+        }
+    }
+    return timeout;
+}
+
+/* Accepts a client, and switches VT according to its command. The client gets
+ * its reply once the VT is active. */
+static void switch_request(int listen_fd, int console, int active) {
+    char buffer[MAX_COMMAND];
+    int fd, n, tty, len = 0;
+
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+        return;
+    while (len < sizeof(buffer)-1 &&
+            (n = read(fd, buffer+len, sizeof(buffer)-1-len)) > 0) {
+        len += n;
+        if (buffer[len-1] == '\n')
+            break;
+    }
+    if (len < 1 || buffer[len-1] != '\n') {
+        close(fd);
+        return;
+    }
+    buffer[len-1] = '\0';
+
+    tty = switch_target(buffer, active);
+    if (tty < 0 || (tty != active && (npending == MAX_PENDING ||
+                        ioctl(console, VT_ACTIVATE, tty) < 0))) {
+        reply(fd, -1);
+    } else if (tty == active) {
+        reply(fd, tty);
+    } else {
+        pending[npending].fd = fd;
+        pending[npending].tty = tty;
+        pending[npending].deadline = now_ms() + SWITCH_TIMEOUT;
+        npending++;
+    }
+}
+
+/* Runs the VT switch daemon. */
+static int switch_daemon() {
+    int fd, console, listen_fd, active;
+    struct pollfd fds[2];
+
+    fd = open(SYSFILE, O_RDONLY);
+    if (fd < 0) {
+        perror("Cannot open " SYSFILE);
+        return 1;
+    }
+    if ((console = open_console()) < 0) {
+        fprintf(stderr, "Cannot open the console.\n");
+        return 1;
+    }
+    listen_fd = socket_listen(CONTROL_SOCKET, SOCK_STREAM, 8);
+    if (listen_fd == -2) {
+        fprintf(stderr, "The VT switch daemon is already running.\n");
+        return 0;
+    } else if (listen_fd < 0) {
+        return 1;
+    }
+
+    if ((active = read_active(fd)) < 0)
+        return 1;
+    scan_ttys();
+
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = fd;
+    fds[0].events = POLLPRI;
+    fds[1].fd = listen_fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        int timeout = reply_pending(active);
+        if (poll(fds, 2, timeout) < 0) {
+            perror("poll error.");
+            return 1;
+        }
+        if (fds[0].revents & POLLPRI) {
+            if ((active = read_active(fd)) < 0)
+                return 1;
+            scan_ttys();
+        }
+        if (fds[1].revents & POLLIN)
+            switch_request(listen_fd, console, active);
+    }
+
+    return 0;
+}
+
+/* Sends a command to the VT switch daemon, and waits for the switch. Returns
+ * the VT that is active, or -1 if the switch failed, or the daemon is not
+ * running. */
+static int switch_command(const char *cmd) {
+    char buffer[MAX_COMMAND];
+    int fd, n, len = 0;
+
+    if ((fd = socket_connect(CONTROL_SOCKET, SOCK_STREAM)) < 0)
+        return -1;
+    len = snprintf(buffer, sizeof(buffer), "%s\n", cmd);
+    if (write(fd, buffer, len) != len) {
+        close(fd);
+        return -1;
+    }
+    len = 0;
+    while (len < sizeof(buffer)-1 &&
+            (n = read(fd, buffer+len, sizeof(buffer)-1-len)) > 0)
+        len += n;
+    close(fd);
+    buffer[len] = '\0';
+    if (strncmp(buffer, "tty", 3))
+        return -1;
+    return atoi(buffer+3);
+}
+
+/* Measures how long switches take, from the request to the VT being active,
+ * alternating between the next and previous VT. */
+static int switch_benchmark(int count) {
+    double *latency = malloc(count * sizeof(double));
+    double sum = 0, start;
+    int i, n = 0, failed = 0;
+
+    if (!latency)
+        return 1;
+    for (i = 0; i < count; i++) {
+        start = now_ms();
+        if (switch_command(i % 2 ? "prev" : "next") < 0) {
+            failed++;
+            continue;
+        }
+        latency[n++] = now_ms() - start;
+    }
+    if (n == 0) {
+        fprintf(stderr, "No switch succeeded: is the daemon running?\n");
+        return 1;
+    }
+    qsort(latency, n, sizeof(double), compare_double);
+    for (i = 0; i < n; i++)
+        sum += latency[i];
+    printf("latency: %d switches, %d failed, mean %.2f ms, p50 %.2f ms, "
+           "p99 %.2f ms, max %.2f ms\n", n, failed, sum / n,
+           latency[n / 2], latency[(int) (n * 0.99)], latency[n-1]);
+    free(latency);
+    return 0;
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "%s [-x|-t]\n", argv0);
+    fprintf(stderr, "%s -d|-c next|prev|cros|-b count\n", argv0);
+    fprintf(stderr, "   Outputs the X11 display that comes to front, on VT "
+                    "changes.\n");
+    fprintf(stderr, "   -x: on Xephyr windows being mapped, as read from\n"
+                    "       croutonxi2event -S -t '' -M on stdin.\n");
+    fprintf(stderr, "   -t: output VT changes (ttyX) instead.\n");
+    fprintf(stderr, "   -d: run the VT switch daemon.\n");
+    fprintf(stderr, "   -c: switch to the next or previous X11 VT, or to\n"
+                    "       Chromium OS, through the daemon.\n");
+    fprintf(stderr, "   -b: measure the latency of count switches.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int xephyr = 0, raw = 0, daemon = 0, count = 0;
+    char *cmd = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "xtdc:b:")) != -1) {
+        switch (c) {
+        case 'x': xephyr = 1; break;
+        case 't': raw = 1; break;
+        case 'd': daemon = 1; break;
+        case 'c': cmd = optarg; break;
+        case 'b':
+            if ((count = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc || xephyr + raw + daemon + !!cmd + !!count > 1)
+        usage(argv[0]);
+
+    if (daemon)
+        return switch_daemon();
+    if (cmd)
+        return switch_command(cmd) < 0 ? 1 : 0;
+    if (count)
+        return switch_benchmark(count);
+
+    return xephyr ? monitor_xephyr() : monitor_vt(raw);
+}
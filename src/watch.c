@@ -0,0 +1,345 @@
+/* Copyright (c) 2013 The Chromium OS Authors. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ *
+ * Event multiplexer: watches sysfs attributes (POLLPRI), files (inotify), X11
+ * root window properties, and timers, and outputs one tagged line per event,
+ * so that scripts can block on events instead of polling:
+ *   TAG VALUE            sysfs attribute or property value (initially, and
+ *                        when it changes)
+ *   TAG EVENT NAME       file EXISTS (initially), CREATE, DELETE or MODIFY
+ *   TAG                  timer expiry
+ * The multiplexer exits after an event matching one of the until patterns
+ * (-u), so that scripts can also wait for a single condition.
+ */
+
+#include <X11/Xlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WATCHES 16
+#define MAX_UNTIL 8
+
+static struct watch {
+    enum { WATCH_SYSFS, WATCH_FILE, WATCH_PROPERTY, WATCH_TIMER } type;
+    char *tag;
+    char *path; /* Attribute/directory path, or property name */
+    char *pattern; /* File name pattern */
+    int fd; /* sysfs file descriptor, or inotify watch descriptor */
+    Atom atom;
+    double period, next; /* Timers, in ms */
+} watches[MAX_WATCHES];
+static int nwatches = 0;
+
+static char *until[MAX_UNTIL];
+static int nuntil = 0;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Parses a TAG=VALUE watch specification. Returns 0 on success. */
+static int watch_add(int type, char *spec) {
+    char *value = strchr(spec, '=');
+    struct watch *watch = &watches[nwatches];
+
+    if (!value || value == spec || nwatches == MAX_WATCHES)
+        return -1;
+    *value++ = '\0';
+    memset(watch, 0, sizeof(*watch));
+    watch->type = type;
+    watch->tag = spec;
+    watch->path = value;
+    watch->fd = -1;
+    if (type == WATCH_TIMER && (watch->period = atof(value) * 1000) <= 0)
+        return -1;
+    nwatches++;
+    return 0;
+}
+
+/* Outputs an event, and exits if it matches one of the until patterns. */
+static void emit(struct watch *watch, const char *event, const char *value) {
+    char line[4096];
+    int i;
+
+    snprintf(line, sizeof(line), "%s%s%s%s%s", watch->tag,
+             event ? " " : "", event ? event : "",
+             value ? " " : "", value ? value : "");
+    /* Events are single lines */
+    line[strcspn(line, "\n")] = '\0';
+    printf("%s\n", line);
+    fflush(stdout);
+    for (i = 0; i < nuntil; i++) {
+        if (fnmatch(until[i], line, 0) == 0)
+            exit(0);
+    }
+}
+
+/* Outputs the current value of a sysfs attribute. */
+static void emit_sysfs(struct watch *watch) {
+    char buffer[4096];
+    int n;
+
+    lseek(watch->fd, 0, SEEK_SET);
+    n = read(watch->fd, buffer, sizeof(buffer)-1);
+    if (n < 0) {
+        perror("Cannot read sysfs attribute");
+        exit(1);
+    }
+    buffer[n] = '\0';
+    emit(watch, NULL, buffer);
+}
+
+/* Outputs the current value of a root window property: text for 8-bit
+ * properties, and space-separated numbers otherwise. */
+static void emit_property(Display *d, struct watch *watch) {
+    Atom type;
+    int format;
+    unsigned long i, nitems, after;
+    unsigned char *data = NULL;
+    char buffer[4096];
+    int len = 0;
+
+    buffer[0] = '\0';
+    if (XGetWindowProperty(d, DefaultRootWindow(d), watch->atom, 0, 1024,
+                           False, AnyPropertyType, &type, &format, &nitems,
+                           &after, &data) == Success && data) {
+        if (format == 8) {
+            snprintf(buffer, sizeof(buffer), "%.*s", (int) nitems, data);
+        } else {
+            for (i = 0; i < nitems && len < sizeof(buffer)-16; i++) {
+                long v = format == 16 ? ((short *) data)[i]
+                                      : ((long *) data)[i];
+                len += snprintf(buffer+len, sizeof(buffer)-len,
+                                i ? " %ld" : "%ld", v);
+            }
+        }
+        XFree(data);
+    }
+    emit(watch, NULL, buffer);
+}
+
+/* Outputs the inotify events matching the file watches. */
+static void emit_inotify(int fd) {
+    char buffer[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *event;
+    int i, n;
+    char *p;
+
+    if ((n = read(fd, buffer, sizeof(buffer))) <= 0)
+        return;
+    for (p = buffer; p < buffer + n; p += sizeof(*event) + event->len) {
+        event = (struct inotify_event *) p;
+        if (!event->len)
+            continue;
+        for (i = 0; i < nwatches; i++) {
+            struct watch *watch = &watches[i];
+            if (watch->type != WATCH_FILE || watch->fd != event->wd ||
+                    fnmatch(watch->pattern, event->name, 0))
+                continue;
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                emit(watch, "CREATE", event->name);
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                emit(watch, "DELETE", event->name);
+            else if (event->mask & IN_CLOSE_WRITE)
+                emit(watch, "MODIFY", event->name);
+        }
+    }
+}
+
+/* Starts watching a file pattern (DIR/PATTERN, or DIR for all its files), and
+ * outputs the files that already exist. */
+static int watch_file(int ifd, struct watch *watch) {
+    struct stat st;
+    struct dirent *entry;
+    DIR *dir;
+    char *slash;
+
+    if (stat(watch->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        watch->pattern = "*";
+    } else if ((slash = strrchr(watch->path, '/'))) {
+        watch->pattern = slash+1;
+        *slash = '\0';
+        if (slash == watch->path)
+            watch->path = "/";
+    } else {
+        watch->pattern = watch->path;
+        watch->path = ".";
+    }
+    watch->fd = inotify_add_watch(ifd, watch->path,
+                                  IN_CREATE | IN_DELETE | IN_MOVED_TO |
+                                  IN_MOVED_FROM | IN_CLOSE_WRITE);
+    if (watch->fd < 0) {
+        perror("Cannot watch directory");
+        return -1;
+    }
+    /* Only list the files once the watch is active, not to miss any */
+    if ((dir = opendir(watch->path))) {
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] != '.' || watch->pattern[0] == '.') {
+                if (fnmatch(watch->pattern, entry->d_name, 0) == 0)
+                    emit(watch, "EXISTS", entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+/* Runs the event multiplexer. */
+static int multiplex() {
+    struct pollfd fds[MAX_WATCHES+2];
+    Display *d = NULL;
+    int ifd = -1;
+    int i, n;
+    double now = now_ms();
+
+    /* Set up all the watches before outputting any initial value */
+    for (i = 0; i < nwatches; i++) {
+        struct watch *watch = &watches[i];
+        switch (watch->type) {
+        case WATCH_SYSFS:
+            if ((watch->fd = open(watch->path, O_RDONLY)) < 0) {
+                perror("Cannot open sysfs attribute");
+                return 1;
+            }
+            break;
+        case WATCH_FILE:
+            if (ifd < 0 && (ifd = inotify_init()) < 0) {
+                perror("inotify_init");
+                return 1;
+            }
+            break;
+        case WATCH_PROPERTY:
+            if (!d) {
+                if (!(d = XOpenDisplay(NULL))) {
+                    fprintf(stderr, "Unable to connect to X server\n");
+                    return 1;
+                }
+                XSelectInput(d, DefaultRootWindow(d), PropertyChangeMask);
+            }
+            watch->atom = XInternAtom(d, watch->path, False);
+            break;
+        case WATCH_TIMER:
+            watch->next = now + watch->period;
+            break;
+        }
+    }
+    for (i = 0; i < nwatches; i++) {
+        if (watches[i].type == WATCH_FILE && watch_file(ifd, &watches[i]) < 0)
+            return 1;
+        else if (watches[i].type == WATCH_PROPERTY)
+            emit_property(d, &watches[i]);
+    }
+
+    /* Poll array: the sysfs attributes, then inotify and X11, if needed.
+     * sysfs attributes report their initial value through the first poll. */
+    for (i = 0, n = 0; i < nwatches; i++) {
+        if (watches[i].type == WATCH_SYSFS) {
+            fds[n].fd = watches[i].fd;
+            fds[n++].events = POLLPRI;
+        }
+    }
+    fds[n].fd = ifd;
+    fds[n++].events = POLLIN;
+    fds[n].fd = d ? ConnectionNumber(d) : -1;
+    fds[n++].events = POLLIN;
+
+    while (1) {
+        int timeout = -1;
+        now = now_ms();
+        for (i = 0; i < nwatches; i++) {
+            struct watch *watch = &watches[i];
+            if (watch->type != WATCH_TIMER)
+                continue;
+            if (now >= watch->next) {
+                emit(watch, NULL, NULL);
+                watch->next += watch->period;
+                if (watch->next < now)
+                    watch->next = now + watch->period;
+            }
+            if (timeout < 0 || watch->next - now + 1 < timeout)
+                timeout = watch->next - now + 1;
+        }
+
+        if (d && XPending(d)) {
+            XEvent event;
+            XNextEvent(d, &event);
+            if (event.type != PropertyNotify)
+                continue;
+            for (i = 0; i < nwatches; i++) {
+                if (watches[i].type == WATCH_PROPERTY &&
+                        watches[i].atom == event.xproperty.atom)
+                    emit_property(d, &watches[i]);
+            }
+            continue;
+        }
+
+        if (poll(fds, n, timeout) < 0) {
+            perror("poll error.");
+            return 1;
+        }
+        if (fds[n-2].revents & POLLIN)
+            emit_inotify(ifd);
+        for (i = 0, n = 0; i < nwatches; i++) {
+            if (watches[i].type == WATCH_SYSFS && fds[n++].revents & POLLPRI)
+                emit_sysfs(&watches[i]);
+        }
+        n += 2;
+    }
+
+    return 0;
+}
+
+static void usage(char *argv0) {
+    fprintf(stderr, "%s [-s|-i|-p|-T tag=...]... [-u pattern]...\n", argv0);
+    fprintf(stderr, "   Outputs \"tag value\" lines for each event of:\n");
+    fprintf(stderr, "   -s: tag=path: a sysfs attribute (with POLLPRI).\n");
+    fprintf(stderr, "   -i: tag=dir[/pattern]: files (EXISTS, CREATE, DELETE\n"
+                    "       or MODIFY name).\n");
+    fprintf(stderr, "   -p: tag=name: a property of the root window.\n");
+    fprintf(stderr, "   -T: tag=seconds: a periodic timer.\n");
+    fprintf(stderr, "   -u: exit after an event line matching the pattern.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "s:i:p:T:u:")) != -1) {
+        switch (c) {
+        case 's':
+        case 'i':
+        case 'p':
+        case 'T':
+            if (watch_add(c == 's' ? WATCH_SYSFS :
+                          c == 'i' ? WATCH_FILE :
+                          c == 'p' ? WATCH_PROPERTY : WATCH_TIMER, optarg) < 0)
+                usage(argv[0]);
+            break;
+        case 'u':
+            if (nuntil == MAX_UNTIL)
+                usage(argv[0]);
+            until[nuntil++] = optarg;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind < argc || !nwatches)
+        usage(argv[0]);
+
+    return multiplex();
+}
@@ -7,6 +7,9 @@
  *
  * Mostly compliant with RFC 6455 - The WebSocket Protocol.
  *
+ * With -c, also synchronizes the clipboard between X11 displays and Chromium
+ * OS (see clipboard functions below).
+ *
  * Things that are supported, but not tested:
  *  - Fragmented packets from client
  *  - Ping packets
@@ -27,6 +30,10 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <ctype.h>
+#include <setjmp.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/extensions/Xfixes.h>
 
 const int BUFFERSIZE = 4096;
 
@@ -1210,6 +1217,636 @@ static void socket_server_init() {
     }
 }
 
+/**/
+/* Clipboard functions */
+/**/
+
+/* With -c, display names (":N") are read from stdin, one per line, every time
+ * a display comes to front (see croutonvtmonitor), and the clipboard content
+ * is transferred from the previous display to the new one. ":0" is Chromium
+ * OS, accessed through the extension, other displays are accessed directly.
+ *
+ * Changes are tracked with XFixes selection notifications, so that clipboards
+ * are only read when they changed, and only written when the content is
+ * different. The content is then served from memory (using INCR for large
+ * transfers), without spawning any process. */
+
+#define MAX_DISPLAYS 8
+#define MAX_INCR 8
+const int CLIP_TIMEOUT = 3000; /* Maximum time to wait for a reply (ms) */
+
+struct clipdisplay {
+    char name[16];
+    Display* display; /* NULL for Chromium OS, or if the display died */
+    Window window; /* Selection owner/requestor window */
+    Atom clipboard, targets, utf8, text, incr, property;
+    int xfixes_event;
+    int owner; /* 1 if we own the clipboard */
+    int synced; /* 1 if the clipboard is known to contain clipdata */
+};
+
+/* INCR transfers in progress */
+struct clipincr {
+    struct clipdisplay* c;
+    Window requestor;
+    Atom property, type;
+    char* data;
+    int length, offset;
+    unsigned long used; /* Value of clipincrclock when last active */
+};
+
+static int clip_enabled = 0;
+static struct clipdisplay clipdisplays[MAX_DISPLAYS];
+static int nclipdisplays = 0;
+static struct clipdisplay* clipcurrent = NULL;
+static struct clipincr clipincrs[MAX_INCR];
+static unsigned long clipincrclock = 0;
+/* Last transferred content */
+static char* clipdata = NULL;
+static int cliplen = 0;
+/* Jump buffer when an X11 connection dies (Xlib would otherwise exit) */
+static jmp_buf clipjmp;
+/* Partial line read on stdin */
+static char clipline[64];
+static int cliplinelen = 0;
+
+/* Send a command to the extension, and read back the reply in a newly
+ * allocated buffer. buffer must have FRAMEMAXHEADERSIZE bytes available
+ * before the data. Returns the reply length, or -1 on error. */
+static int socket_client_command(char* buffer, int len, char** reply) {
+    int fin = 0;
+    uint32_t maskkey;
+    int retry = 0;
+    int replylen = 0;
+
+    *reply = NULL;
+
+    if (client_fd < 0) {
+        log(1, "No client FD.");
+        return -1;
+    }
+
+    if (socket_client_write_frame(buffer, len, WS_OPCODE_TEXT, 1) < 0) {
+        error("Error writing frame.");
+        return -1;
+    }
+
+    /* Read possibly fragmented message from WebSocket. */
+    while (fin != 1) {
+        int curlen = socket_client_read_frame_header(&fin, &maskkey, &retry);
+
+        if (retry)
+            continue;
+
+        if (curlen < 0 || replylen+curlen > MAXFRAMESIZE)
+            break;
+
+        char* newreply = realloc(*reply, replylen+curlen+1);
+        if (!newreply) {
+            error("Cannot allocate reply buffer.");
+            break;
+        }
+        *reply = newreply;
+        if (socket_client_read_frame_data(*reply+replylen, curlen,
+                                          maskkey) < 0)
+            break;
+        replylen += curlen;
+    }
+
+    if (fin != 1) {
+        free(*reply);
+        *reply = NULL;
+        return -1;
+    }
+
+    return replylen;
+}
+
+static int clip_error_handler(Display* display, XErrorEvent* event) {
+    /* Requestor windows may vanish at any time: ignore all errors. */
+    log(2, "X11 error (request %d, code %d).",
+        event->request_code, event->error_code);
+    return 0;
+}
+
+static int clip_io_error_handler(Display* display) {
+    int i;
+
+    /* The display is gone (e.g. the session was closed): the connection
+     * cannot be closed cleanly, leak it, and go back to the main loop. */
+    for (i = 0; i < nclipdisplays; i++) {
+        if (clipdisplays[i].display == display) {
+            error("Lost connection to display %s.", clipdisplays[i].name);
+            clipdisplays[i].display = NULL;
+            clipdisplays[i].owner = 0;
+            clipdisplays[i].synced = 0;
+        }
+    }
+    for (i = 0; i < MAX_INCR; i++) {
+        if (clipincrs[i].c && !clipincrs[i].c->display) {
+            free(clipincrs[i].data);
+            clipincrs[i].c = NULL;
+        }
+    }
+    longjmp(clipjmp, 1);
+    return 0;
+}
+
+/* Return the display structure for name, opening the display if needed. */
+static struct clipdisplay* clip_display(char* name) {
+    struct clipdisplay* c = NULL;
+    int i, xfixes_error;
+
+    for (i = 0; i < nclipdisplays; i++) {
+        if (!strcmp(clipdisplays[i].name, name)) {
+            c = &clipdisplays[i];
+            if (c->display || !strcmp(name, ":0"))
+                return c;
+            break;
+        }
+    }
+
+    if (!c) {
+        if (nclipdisplays == MAX_DISPLAYS) {
+            error("Too many displays.");
+            return NULL;
+        }
+        c = &clipdisplays[nclipdisplays++];
+        memset(c, 0, sizeof(*c));
+        snprintf(c->name, sizeof(c->name), "%s", name);
+        if (!strcmp(name, ":0"))
+            return c;
+    }
+
+    if (!(c->display = XOpenDisplay(name))) {
+        error("Unable to open display '%s'.", name);
+        return c;
+    }
+
+    Display* d = c->display;
+    c->window = XCreateSimpleWindow(d, DefaultRootWindow(d),
+                                    0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(d, c->window, PropertyChangeMask);
+    c->clipboard = XInternAtom(d, "CLIPBOARD", False);
+    c->targets = XInternAtom(d, "TARGETS", False);
+    c->utf8 = XInternAtom(d, "UTF8_STRING", False);
+    c->text = XInternAtom(d, "TEXT", False);
+    c->incr = XInternAtom(d, "INCR", False);
+    c->property = XInternAtom(d, "CROUTON_CLIPBOARD", False);
+    c->owner = 0;
+    c->synced = 0;
+    if (!XFixesQueryExtension(d, &c->xfixes_event, &xfixes_error)) {
+        /* Without notifications, the clipboard is read on every switch. */
+        error("XFixes not available on display '%s'.", name);
+        c->xfixes_event = -1;
+    } else {
+        XFixesSelectSelectionInput(d, DefaultRootWindow(d), c->clipboard,
+                                   XFixesSetSelectionOwnerNotifyMask |
+                                   XFixesSelectionWindowDestroyNotifyMask |
+                                   XFixesSelectionClientCloseNotifyMask);
+    }
+    XFlush(d);
+    log(1, "Opened display %s.", name);
+    return c;
+}
+
+/* Maximum property size that can be set in one request. */
+static int clip_maxsize(Display* d) {
+    return XMaxRequestSize(d)*4 - 256;
+}
+
+/* Send the next chunk of an INCR transfer, after the requestor deleted the
+ * property. An empty chunk terminates the transfer. */
+static void clip_incr_next(struct clipincr* incr) {
+    Display* d = incr->c->display;
+    int len = incr->length - incr->offset;
+
+    if (len > clip_maxsize(d))
+        len = clip_maxsize(d);
+    XChangeProperty(d, incr->requestor, incr->property, incr->type, 8,
+                    PropModeReplace, (unsigned char*)incr->data+incr->offset,
+                    len);
+    log(3, "INCR chunk %d+%d/%d", incr->offset, len, incr->length);
+    incr->used = ++clipincrclock;
+    if (len == 0) {
+        XSelectInput(d, incr->requestor, NoEventMask);
+        free(incr->data);
+        incr->c = NULL;
+    }
+    incr->offset += len;
+}
+
+/* Serve a selection request, when we own the clipboard. */
+static void clip_serve(struct clipdisplay* c, XSelectionRequestEvent* req) {
+    Display* d = c->display;
+    XSelectionEvent ev;
+    /* Obsolete clients do not set the property */
+    Atom property = req->property != None ? req->property : req->target;
+    int i;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = SelectionNotify;
+    ev.requestor = req->requestor;
+    ev.selection = req->selection;
+    ev.target = req->target;
+    ev.time = req->time;
+    ev.property = None;
+
+    if (req->selection != c->clipboard || !c->owner) {
+        /* Refuse */
+    } else if (req->target == c->targets) {
+        Atom targets[] = { c->targets, c->utf8, XA_STRING, c->text };
+        XChangeProperty(d, req->requestor, property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char*)targets,
+                        sizeof(targets)/sizeof(targets[0]));
+        ev.property = property;
+    } else if (req->target == c->utf8 || req->target == XA_STRING ||
+               req->target == c->text) {
+        Atom type = req->target == XA_STRING ? XA_STRING : c->utf8;
+        if (cliplen <= clip_maxsize(d)) {
+            XChangeProperty(d, req->requestor, property, type, 8,
+                            PropModeReplace, (unsigned char*)clipdata,
+                            cliplen);
+            ev.property = property;
+        } else {
+            /* Reuse the slot of the same requestor, or a free one, or the
+             * least recently active one, in case requestors vanished during
+             * a transfer. */
+            struct clipincr* incr = NULL;
+            for (i = 0; i < MAX_INCR && !incr; i++) {
+                if (clipincrs[i].c == c &&
+                        clipincrs[i].requestor == req->requestor)
+                    incr = &clipincrs[i];
+            }
+            for (i = 0; i < MAX_INCR && !incr; i++) {
+                if (!clipincrs[i].c)
+                    incr = &clipincrs[i];
+            }
+            if (!incr) {
+                incr = &clipincrs[0];
+                for (i = 1; i < MAX_INCR; i++) {
+                    if (clipincrs[i].used < incr->used)
+                        incr = &clipincrs[i];
+                }
+            }
+            if (incr->c)
+                free(incr->data);
+            /* The clipboard may change during the transfer */
+            incr->data = malloc(cliplen);
+            if (!incr->data) {
+                error("Cannot allocate INCR buffer.");
+                incr->c = NULL;
+                XSendEvent(d, req->requestor, False, NoEventMask,
+                           (XEvent*)&ev);
+                return;
+            }
+            incr->c = c;
+            incr->requestor = req->requestor;
+            incr->property = property;
+            incr->type = type;
+            incr->length = cliplen;
+            incr->offset = 0;
+            incr->used = ++clipincrclock;
+            memcpy(incr->data, clipdata, cliplen);
+            log(2, "Starting INCR transfer (%d bytes).", cliplen);
+
+            long size = cliplen;
+            XSelectInput(d, req->requestor, PropertyChangeMask);
+            XChangeProperty(d, req->requestor, property, c->incr, 32,
+                            PropModeReplace, (unsigned char*)&size, 1);
+            ev.property = property;
+        }
+    }
+
+    XSendEvent(d, req->requestor, False, NoEventMask, (XEvent*)&ev);
+}
+
+/* Handle an X11 event that is not part of a read operation. */
+static void clip_event(struct clipdisplay* c, XEvent* event) {
+    int i;
+
+    if (c->xfixes_event >= 0 &&
+            event->type == c->xfixes_event + XFixesSelectionNotify) {
+        XFixesSelectionNotifyEvent* sev = (XFixesSelectionNotifyEvent*)event;
+        if (sev->owner != c->window) {
+            log(2, "Clipboard changed on %s.", c->name);
+            c->synced = 0;
+        }
+    } else if (event->type == SelectionClear) {
+        if (event->xselectionclear.window == c->window) {
+            c->owner = 0;
+            c->synced = 0;
+        }
+    } else if (event->type == SelectionRequest) {
+        clip_serve(c, &event->xselectionrequest);
+    } else if (event->type == PropertyNotify &&
+               event->xproperty.state == PropertyDelete) {
+        for (i = 0; i < MAX_INCR; i++) {
+            struct clipincr* incr = &clipincrs[i];
+            if (incr->c == c && incr->requestor == event->xproperty.window &&
+                    incr->property == event->xproperty.atom)
+                clip_incr_next(incr);
+        }
+    }
+}
+
+/* Handle all pending events on a display, and flush requests. */
+static void clip_dispatch(struct clipdisplay* c) {
+    XEvent event;
+
+    while (c->display && XPending(c->display)) {
+        XNextEvent(c->display, &event);
+        clip_event(c, &event);
+    }
+    if (c->display)
+        XFlush(c->display);
+}
+
+/* Wait for an event on our window (SelectionNotify, or a new value of our
+ * property), handling other events in the meantime. Returns 0 on success, -1
+ * on timeout. */
+static int clip_wait(struct clipdisplay* c, int type, XEvent* event) {
+    Display* d = c->display;
+    struct pollfd fd = { .fd = ConnectionNumber(d), .events = POLLIN };
+    int timeout = CLIP_TIMEOUT;
+
+    while (1) {
+        while (XPending(d)) {
+            XNextEvent(d, event);
+            if (event->type == type && event->xany.window == c->window) {
+                if (type == SelectionNotify ||
+                        (event->xproperty.atom == c->property &&
+                         event->xproperty.state == PropertyNewValue))
+                    return 0;
+            }
+            clip_event(c, event);
+        }
+        /* Not accurate, but good enough for a timeout */
+        if (timeout <= 0 || poll(&fd, 1, 100) < 0)
+            return -1;
+        timeout -= 100;
+    }
+}
+
+/* Read the clipboard of an X11 display into clipdata. Returns 0 on success,
+ * -1 on error. */
+static int clip_read_x11(struct clipdisplay* c) {
+    Display* d = c->display;
+    Atom target = c->utf8;
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char* data;
+    XEvent event;
+    char* buffer = NULL;
+    int length = 0;
+
+    if (XGetSelectionOwner(d, c->clipboard) == None) {
+        /* Empty clipboard */
+        free(clipdata);
+        clipdata = NULL;
+        cliplen = 0;
+        return 0;
+    }
+
+    while (1) {
+        XConvertSelection(d, c->clipboard, target, c->property, c->window,
+                          CurrentTime);
+        if (clip_wait(c, SelectionNotify, &event) < 0) {
+            error("Timeout reading clipboard on %s.", c->name);
+            return -1;
+        }
+        if (event.xselection.property != None)
+            break;
+        /* Owner refused UTF8_STRING: try STRING */
+        if (target == XA_STRING) {
+            error("Clipboard of %s cannot be converted to text.", c->name);
+            return -1;
+        }
+        target = XA_STRING;
+    }
+
+    /* Read the property (deleting it), then the chunks if this is an INCR
+     * transfer, until an empty chunk. */
+    int incr = 0;
+    while (1) {
+        if (XGetWindowProperty(d, c->window, c->property, 0, MAXFRAMESIZE/4,
+                               True, AnyPropertyType, &type, &format,
+                               &nitems, &after, &data) != Success) {
+            free(buffer);
+            return -1;
+        }
+        if (type == c->incr) {
+            incr = 1;
+            nitems = 0;
+        } else if (format == 8 && nitems > 0) {
+            char* newbuffer = realloc(buffer, length+nitems);
+            if (!newbuffer) {
+                error("Cannot allocate clipboard buffer.");
+                XFree(data);
+                free(buffer);
+                return -1;
+            }
+            buffer = newbuffer;
+            memcpy(buffer+length, data, nitems);
+            length += nitems;
+        }
+        XFree(data);
+        if (!incr || (type != c->incr && nitems == 0))
+            break;
+        if (clip_wait(c, PropertyNotify, &event) < 0) {
+            error("Timeout in INCR transfer on %s.", c->name);
+            free(buffer);
+            return -1;
+        }
+    }
+
+    free(clipdata);
+    clipdata = buffer;
+    cliplen = length;
+    return 0;
+}
+
+/* Read the clipboard of a display into clipdata. Returns 0 on success, -1 on
+ * error. */
+static int clip_read(struct clipdisplay* c) {
+    char buffer[FRAMEMAXHEADERSIZE+1];
+    char* reply;
+    int len;
+
+    if (c->display)
+        return clip_read_x11(c);
+
+    if (strcmp(c->name, ":0")) {
+        error("Unable to open display '%s'.", c->name);
+        return -1;
+    }
+
+    buffer[FRAMEMAXHEADERSIZE] = 'R';
+    len = socket_client_command(buffer, 1, &reply);
+    if (len < 1 || reply[0] != 'R') {
+        error("Cannot read clipboard from Chromium OS: %.*s",
+              len > 0 ? len : 0, reply ? reply : "");
+        free(reply);
+        return -1;
+    }
+
+    /* Strip the 'R' status */
+    memmove(reply, reply+1, len-1);
+    free(clipdata);
+    clipdata = reply;
+    cliplen = len-1;
+    return 0;
+}
+
+/* Write clipdata to the clipboard of a display. Returns 0 on success, -1 on
+ * error. */
+static int clip_write(struct clipdisplay* c) {
+    char* buffer;
+    char* reply;
+    int len;
+
+    if (c->display) {
+        XSetSelectionOwner(c->display, c->clipboard, c->window, CurrentTime);
+        if (XGetSelectionOwner(c->display, c->clipboard) != c->window) {
+            error("Cannot own the clipboard of %s.", c->name);
+            return -1;
+        }
+        c->owner = 1;
+        return 0;
+    }
+
+    if (strcmp(c->name, ":0"))
+        return -1;
+
+    buffer = malloc(FRAMEMAXHEADERSIZE+1+cliplen);
+    if (!buffer) {
+        error("Cannot allocate clipboard buffer.");
+        return -1;
+    }
+    buffer[FRAMEMAXHEADERSIZE] = 'W';
+    memcpy(buffer+FRAMEMAXHEADERSIZE+1, clipdata, cliplen);
+    len = socket_client_command(buffer, 1+cliplen, &reply);
+    free(buffer);
+    if (len != 3 || memcmp(reply, "WOK", 3)) {
+        error("Cannot write clipboard to Chromium OS: %.*s",
+              len > 0 ? len : 0, reply ? reply : "");
+        free(reply);
+        return -1;
+    }
+    free(reply);
+    return 0;
+}
+
+/* A display came to front: transfer the clipboard from the current one. */
+static void clip_switch(char* name) {
+    struct clipdisplay* volatile next = NULL;
+    char* olddata;
+    int oldlen, i;
+
+    if (setjmp(clipjmp)) {
+        /* A display died: the clipboard content may be lost */
+        clipcurrent = next;
+        return;
+    }
+
+    next = clip_display(name);
+    if (!next || next == clipcurrent)
+        return;
+
+    if (!clipcurrent) {
+        clipcurrent = next;
+        return;
+    }
+
+    log(1, "Switch %s -> %s.", clipcurrent->name, next->name);
+
+    /* Handle pending XFixes notifications, so that synced is up to date */
+    clip_dispatch(clipcurrent);
+
+    /* Chromium OS does not notify changes: always read it (same for
+     * displays without XFixes, unless we own the clipboard). */
+    if (!clipcurrent->synced || !clipcurrent->display ||
+            (clipcurrent->xfixes_event < 0 && !clipcurrent->owner)) {
+        olddata = clipdata;
+        oldlen = cliplen;
+        clipdata = NULL;
+        if (clip_read(clipcurrent) < 0) {
+            /* The clipboard content is lost in this case */
+            clipdata = olddata;
+            cliplen = oldlen;
+            clipcurrent = next;
+            return;
+        }
+        /* Do not write displays again if the content is the same */
+        if (olddata && cliplen == oldlen &&
+                !memcmp(clipdata, olddata, cliplen)) {
+            log(2, "Clipboard unchanged.");
+        } else {
+            /* Clipboards we own serve the new content already */
+            for (i = 0; i < nclipdisplays; i++)
+                clipdisplays[i].synced = clipdisplays[i].owner;
+        }
+        if (olddata != clipdata)
+            free(olddata);
+        clipcurrent->synced = 1;
+    }
+
+    if (!next->synced) {
+        if (clip_write(next) < 0) {
+            /* Write failed: keep the current display, to transfer its
+             * clipboard on the next switch. */
+            if (!next->display)
+                return;
+        } else {
+            next->synced = 1;
+        }
+    }
+
+    clipcurrent = next;
+}
+
+/* Handle pending events on all displays. */
+static void clip_dispatch_all() {
+    volatile int i = 0;
+
+    /* If a display died, carry on with the next one */
+    if (setjmp(clipjmp))
+        i++;
+    for (; i < nclipdisplays; i++)
+        clip_dispatch(&clipdisplays[i]);
+}
+
+/* Read display names from stdin. Returns -1 on EOF. */
+static int clip_stdin_read() {
+    int n, i;
+    char* line;
+
+    n = read(STDIN_FILENO, clipline+cliplinelen,
+             sizeof(clipline)-cliplinelen-1);
+    if (n <= 0)
+        return -1;
+    cliplinelen += n;
+    clipline[cliplinelen] = '\0';
+
+    line = clipline;
+    for (i = 0; i < cliplinelen; i++) {
+        if (clipline[i] == '\n') {
+            clipline[i] = '\0';
+            if (*line)
+                clip_switch(line);
+            line = clipline+i+1;
+        }
+    }
+
+    cliplinelen -= line-clipline;
+    memmove(clipline, line, cliplinelen);
+    /* Drop overlong lines */
+    if (cliplinelen == sizeof(clipline)-1)
+        cliplinelen = 0;
+    return 0;
+}
+
 static int terminate = 0;
 
 static void signal_handler(int sig) {
@@ -1217,26 +1854,34 @@ static void signal_handler(int sig) {
 }
 
 int main(int argc, char **argv) {
-    int n;
+    int n, i;
     /* Poll array:
      * 0 - server_fd
      * 1 - pipein_fd
      * 2 - client_fd (if any)
+     * 3 - stdin (with -c)
+     * 4+ - X11 displays (with -c)
      */
-    struct pollfd fds[3];
+    struct pollfd fds[4+MAX_DISPLAYS];
     int nfds = 3;
     sigset_t sigmask;
     sigset_t sigmask_orig;
     struct sigaction act;
     int c;
 
-    while ((c = getopt(argc, argv, "v:")) != -1) {
+    while ((c = getopt(argc, argv, "cv:")) != -1) {
         switch (c) {
+        case 'c':
+            clip_enabled = 1;
+            break;
         case 'v':
             verbose = atoi(optarg);
             break;
         default:
-            fprintf(stderr, "%s [-v 0-3]\n", argv[0]);
+            fprintf(stderr, "%s [-c] [-v 0-3]\n", argv[0]);
+            fprintf(stderr, "   -c: synchronize the clipboard, reading the "
+                            "displays that come\n"
+                            "       to front on stdin (croutonvtmonitor).\n");
             return 1;
         }
     }
@@ -1279,6 +1924,13 @@ int main(int argc, char **argv) {
     fds[0].events = POLLIN;
     fds[1].events = POLLIN;
     fds[2].events = POLLIN;
+    for (n = 3; n < 4+MAX_DISPLAYS; n++)
+        fds[n].events = POLLIN;
+
+    if (clip_enabled) {
+        XSetErrorHandler(clip_error_handler);
+        XSetIOErrorHandler(clip_io_error_handler);
+    }
 
     /* Initialise pipe and WebSocket server */
     socket_server_init();
@@ -1289,6 +1941,16 @@ int main(int argc, char **argv) {
         fds[0].fd = server_fd;
         fds[1].fd = pipein_fd;
         fds[2].fd = client_fd;
+        if (clip_enabled) {
+            /* Events may be queued by Xlib already */
+            clip_dispatch_all();
+            fds[3].fd = STDIN_FILENO;
+            for (n = 0; n < nclipdisplays; n++) {
+                fds[4+n].fd = clipdisplays[n].display ?
+                        ConnectionNumber(clipdisplays[n].display) : -1;
+            }
+            nfds = 4+nclipdisplays;
+        }
 
         /* Only handle signals in ppoll: this makes sure we complete processing
          * the current request before bailing out. */
@@ -1319,6 +1981,20 @@ int main(int argc, char **argv) {
             socket_client_read();
             n--;
         }
+        if (clip_enabled && fds[3].revents) {
+            log(2, "Stdin ready.");
+            if (clip_stdin_read() < 0) {
+                log(1, "End of display list.");
+                terminate = 1;
+            }
+            n--;
+        }
+        for (i = 4; i < nfds; i++) {
+            if (fds[i].revents) {
+                clip_dispatch_all();
+                n--;
+            }
+        }
 
         if (n > 0) { /* Some events were not handled, this is a problem */
             error("Some poll events could not be handled: "
@@ -4,136 +4,1776 @@
  *
  * Monitors and displays XInput 2 raw events, such as key presses, mouse
  * motion/clicks, etc.
+ *
+ * The reported event types and valuators can be filtered, consecutive motion
+ * events merged, and the output flushed in batches, so that consumers are not
+ * flooded by fast input devices.
+ *
+ * In wheel mode (-w), converts trackpad scrolling valuators into mouse wheel
+ * clicks, injected with XTest, unless the Chromium OS (aura) window is mapped.
+ * This is the mouse wheel daemon used by croutonwheel.
+ *
+ * In gesture mode (-g), recognizes touchscreen gestures: two-finger scrolling
+ * and pinching, and swipes of three fingers or more, and injects the matching
+ * wheel clicks and key presses with XTest. Touches are grabbed on the root
+ * window until they are recognized: the touches of a gesture are accepted, so
+ * that clients do not also see them as clicks or drags, and the others are
+ * rejected, i.e. replayed to the clients.
+ *
+ * In idle monitor mode (-i), tells Chromium OS's powerd about user activity,
+ * through the D-Bus bridge (croutondbus), at most once per interval.
+ *
+ * In hub mode (-s), keeps the only connection to the X server, and publishes
+ * the events to local subscribers (-S), which fall back to connecting to the
+ * X server directly if there is no hub.
+ *
+ * Events can be recorded to a binary trace (-R), with their X server and
+ * receive times, and replayed (-P) at the original pacing through XTest,
+ * either directly, or through the mouse wheel daemon or the gesture
+ * recognizer, to benchmark latency and tune scrolling on a test X server
+ * (e.g. Xvfb).
  */
 
 #include <X11/Xlib.h>
 #include <X11/extensions/XInput.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/XTest.h>
 #include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
-/* Print a XIRawEvent, including the list of valuators, all on one line. */
-static void print_rawevent(XIRawEvent *event) {
+#include "socket.h"
+
+/* Maximum number of valuators considered in a raw event */
+#define MAX_VALUATORS 32
+
+/* Raw event types that can be monitored */
+static const int raw_types[] = {
+    XI_RawKeyPress, XI_RawKeyRelease, XI_RawButtonPress, XI_RawButtonRelease,
+    XI_RawMotion, XI_RawTouchBegin, XI_RawTouchUpdate, XI_RawTouchEnd,
+};
+
+/* Event masks: bit n selects the raw event type n, EVENT_MASK_MAP selects the
+ * map/unmap events of top-level windows. */
+#define EVENT_MASK_MAP (1u << 31)
+#define EVENT_MASK_RAW(type) (1u << (type))
+
+/* Returns the mask of all the raw event types that can be monitored. */
+static uint32_t raw_types_mask() {
+    uint32_t mask = 0;
     int i;
-    int lasti = -1;
-    double *val;
+    for (i = 0; i < sizeof(raw_types)/sizeof(*raw_types); i++)
+        mask |= EVENT_MASK_RAW(raw_types[i]);
+    return mask;
+}
 
-    printf("EVENT type %d ", event->evtype);
-    printf("device %d %d ", event->deviceid, event->sourceid);
-    printf("detail %d ", event->detail);
-    printf("valuators");
+/* Maximum length of a window name in map events */
+#define MAX_NAME 128
+
+/* An input event, received from the X11 server or from a hub */
+struct input_event {
+    enum { EVENT_RAW, EVENT_MAP } kind;
+    int type; /* XI raw event type, or MapNotify/UnmapNotify */
+    Time time;
+    /* Raw events */
+    int deviceid, sourceid, detail;
+    int absolute; /* Motion of a device with absolute valuators */
+    int nvaluators; /* Up to the last valuator that is set */
+    double values[MAX_VALUATORS]; /* nan if the valuator is not set */
+    /* Map events */
+    Window window;
+    int override_redirect;
+    char name[MAX_NAME];
+};
+
+/* Error code of XI BadDevice errors */
+static int xi_bad_device = -1;
+
+/* Valuator modes of the source devices, queried on their first motion event:
+ * 0 if not queried yet, 1 for relative, 2 for absolute. Cleared when the
+ * device hierarchy changes, as the ids of removed devices are reused. */
+static char device_modes[256];
+
+/* Returns 1 if the device has absolute valuators (e.g. a touchscreen). */
+static int device_absolute(Display *display, int deviceid) {
+    XIDeviceInfo *info;
+    int i, n;
+
+    if (deviceid < 0 || deviceid >= sizeof(device_modes))
+        return 0;
+    if (!device_modes[deviceid]) {
+        device_modes[deviceid] = 1;
+        /* NULL if the device is already gone (BadDevice is ignored) */
+        info = XIQueryDevice(display, deviceid, &n);
+        for (i = 0; info && i < info->num_classes; i++) {
+            XIValuatorClassInfo *v = (XIValuatorClassInfo *) info->classes[i];
+            if (v->type == XIValuatorClass && v->mode == XIModeAbsolute)
+                device_modes[deviceid] = 2;
+        }
+        if (info)
+            XIFreeDeviceInfo(info);
+    }
+    return device_modes[deviceid] == 2;
+}
+
+/* Converts a XIRawEvent, setting the valuators that are not set to nan. */
+static void raw_to_event(Display *display, XIRawEvent *raw,
+                         struct input_event *event) {
+    int i;
+    double *val = raw->valuators.values;
+
+    event->kind = EVENT_RAW;
+    event->type = raw->evtype;
+    event->time = raw->time;
+    event->deviceid = raw->deviceid;
+    event->sourceid = raw->sourceid;
+    event->detail = raw->detail;
+    event->absolute = raw->evtype == XI_RawMotion &&
+                      device_absolute(display, raw->sourceid);
+    event->nvaluators = 0;
+    for (i = 0; i < raw->valuators.mask_len * 8 && i < MAX_VALUATORS; i++) {
+        if (XIMaskIsSet(raw->valuators.mask, i)) {
+            event->values[i] = *val++;
+            event->nvaluators = i+1;
+        } else {
+            event->values[i] = NAN;
+        }
+    }
+}
+
+/* Converts a MapNotify/UnmapNotify event, fetching the window name. */
+static void map_to_event(Display *display, XEvent *xevent,
+                         struct input_event *event) {
+    char *name = NULL;
+
+    event->kind = EVENT_MAP;
+    event->type = xevent->type;
+    event->time = CurrentTime;
+    if (xevent->type == MapNotify) {
+        event->window = xevent->xmap.window;
+        event->override_redirect = xevent->xmap.override_redirect;
+    } else {
+        event->window = xevent->xunmap.window;
+        event->override_redirect = 0;
+    }
+    event->name[0] = '\0';
+    if (xevent->type == MapNotify &&
+            XFetchName(display, event->window, &name) && name) {
+        snprintf(event->name, sizeof(event->name), "%s", name);
+        XFree(name);
+    }
+}
+
+/* Selects raw and map events on the root window. */
+static void select_events(Display *display, Window root, uint32_t mask) {
+    XIEventMask eventmask;
+    unsigned char ximask[XIMaskLen(XI_LASTEVENT)];
+    int i;
+
+    memset(ximask, 0, sizeof(ximask));
+    for (i = 0; i < sizeof(raw_types)/sizeof(*raw_types); i++) {
+        if (mask & EVENT_MASK_RAW(raw_types[i]))
+            XISetMask(ximask, raw_types[i]);
+    }
+    /* To forget the valuator modes of removed devices */
+    if (mask & EVENT_MASK_RAW(XI_RawMotion))
+        XISetMask(ximask, XI_HierarchyChanged);
+    eventmask.deviceid = XIAllMasterDevices;
+    eventmask.mask = ximask;
+    eventmask.mask_len = sizeof(ximask);
+    XISelectEvents(display, root, &eventmask, 1);
+    XSelectInput(display, root,
+                 (mask & EVENT_MASK_MAP) ? SubstructureNotifyMask : NoEventMask);
+    XFlush(display);
+}
+
+/* Windows and devices may be gone by the time they are queried: ignore
+ * BadWindow and BadDevice, and exit on other errors, like the default
+ * handler. */
+static int error_handler(Display *display, XErrorEvent *e) {
+    if (e->error_code == BadWindow || e->error_code == xi_bad_device)
+        return 0;
+    fprintf(stderr, "X11 error: %d, %d, %d\n",
+            e->error_code, e->request_code, e->minor_code);
+    exit(1);
+}
+
+/* Output filtering, coalescing and batching */
 
-    /* Get the index of the last valuator that is set */
-    for (i = 0; i < event->valuators.mask_len * 8; i++) {
-        if (XIMaskIsSet(event->valuators.mask, i)) {
-            lasti = i;
+/* Valuators that are reported (all of them if valuator_filter is 0) */
+static int valuator_filter = 0;
+static uint32_t valuator_mask = 0;
+/* Time window in ms in which consecutive motion events are merged (0: off) */
+static int merge_window = 0;
+/* Interval in ms at which the output is flushed (0: line buffering) */
+static int flush_interval = 0;
+/* Some output has not been flushed yet */
+static int output_pending = 0;
+
+/* Motion event being merged */
+static struct {
+    int active;
+    double deadline;
+    struct input_event event;
+} motion;
+
+/* Returns the CLOCK_MONOTONIC time in ms. */
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Print a raw event, including the list of valuators, all on one line. */
+static void print_event(struct input_event *event) {
+    double *values = event->values;
+    int n = event->nvaluators;
+    int i;
+
+    /* Filtered valuators are reported as nan, so that the number of fields
+     * does not depend on the filter. */
+    if (valuator_filter) {
+        for (i = 0; i < n; i++) {
+            if (!(valuator_mask & (1u << i)))
+                values[i] = NAN;
         }
     }
 
+    printf("EVENT type %d ", event->type);
+    printf("device %d %d ", event->deviceid, event->sourceid);
+    printf("detail %d ", event->detail);
+    printf("valuators");
+
     /* Print each valuator's value, nan if the valuator is not set. */
-    val = event->valuators.values;
-    for (i = 0; i <= lasti; i++) {
-        if (XIMaskIsSet(event->valuators.mask, i)) {
-            printf(" %.2f", *val++);
+    for (i = 0; i < n; i++) {
+        if (!isnan(values[i])) {
+            printf(" %.2f", values[i]);
         } else {
             printf(" nan");
         }
     }
     printf("\n");
+    output_pending = 1;
+}
+
+/* Print the motion event being merged, if any. */
+static void flush_motion() {
+    if (motion.active) {
+        print_event(&motion.event);
+        motion.active = 0;
+    }
+}
+
+/* Merge a relative motion event into the pending one, summing the deltas of
+ * each valuator. Events from another device are never merged. */
+static void merge_motion(struct input_event *event) {
+    struct input_event *merged = &motion.event;
+    int i;
+
+    if (motion.active && (merged->deviceid != event->deviceid ||
+                          merged->sourceid != event->sourceid))
+        flush_motion();
+
+    if (!motion.active) {
+        motion.active = 1;
+        motion.deadline = now_ms() + merge_window;
+        *merged = *event;
+        return;
+    }
+
+    for (i = 0; i < event->nvaluators; i++) {
+        if (i >= merged->nvaluators || isnan(merged->values[i]))
+            merged->values[i] = event->values[i];
+        else if (!isnan(event->values[i]))
+            merged->values[i] += event->values[i];
+    }
+    if (event->nvaluators > merged->nvaluators)
+        merged->nvaluators = event->nvaluators;
+    merged->time = event->time;
+}
+
+/* Print an event, or merge it with the previous ones if it is a relative
+ * motion event and merging is enabled. */
+static void print_input(struct input_event *event) {
+    if (event->kind == EVENT_MAP) {
+        flush_motion();
+        printf("%s window 0x%lx override %d name %s\n",
+               event->type == MapNotify ? "MAP" : "UNMAP",
+               event->window, event->override_redirect, event->name);
+        output_pending = 1;
+        return;
+    }
+    if (merge_window > 0 && event->type == XI_RawMotion && !event->absolute) {
+        merge_motion(event);
+        return;
+    }
+    /* Keep events in order */
+    flush_motion();
+    print_event(event);
+}
+
+/* Flush what is due, and return the time until the next deadline in ms, or
+ * -1 if there is none. */
+static int flush_output(double *last_flush) {
+    double now = now_ms();
+    int timeout = -1;
+
+    if (motion.active) {
+        if (now >= motion.deadline)
+            flush_motion();
+        else
+            timeout = motion.deadline - now + 1;
+    }
+    if (output_pending) {
+        if (!flush_interval || now >= *last_flush + flush_interval) {
+            fflush(stdout);
+            output_pending = 0;
+            *last_flush = now;
+        } else {
+            int remaining = *last_flush + flush_interval - now + 1;
+            if (timeout < 0 || remaining < timeout)
+                timeout = remaining;
+        }
+    }
+    return timeout;
+}
+
+/* Parses a comma-separated list of integers between 0 and max-1 into a bit
+ * mask. An empty list gives an empty mask. Returns 0 on success, -1 on error. */
+static int parse_list(char *list, uint32_t *mask, int max) {
+    char *end;
+    *mask = 0;
+    if (!*list)
+        return 0;
+    do {
+        long i = strtol(list, &end, 10);
+        if (end == list || i < 0 || i >= max || (*end && *end != ','))
+            return -1;
+        *mask |= 1u << i;
+        list = end+1;
+    } while (*end);
+    return 0;
+}
+
+/* Latency statistics, in ms */
+struct latency {
+    const char *name;
+    int count, size;
+    int lost;
+    double *samples;
+};
+
+static void latency_add(struct latency *latency, double sample) {
+    if (latency->count == latency->size) {
+        int size = latency->size ? latency->size*2 : 1024;
+        double *samples = realloc(latency->samples, size*sizeof(double));
+        if (!samples)
+            return;
+        latency->samples = samples;
+        latency->size = size;
+    }
+    latency->samples[latency->count++] = sample;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Prints the latency distribution on stderr. */
+static void latency_summary(struct latency *latency) {
+    double *samples = latency->samples;
+    int n = latency->count;
+    double sum = 0;
+    int i;
+
+    if (n == 0) {
+        fprintf(stderr, "%s latency: no samples, %d lost\n",
+                latency->name, latency->lost);
+        return;
+    }
+    qsort(samples, n, sizeof(double), compare_double);
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+    fprintf(stderr, "%s latency: %d events, %d lost, mean %.2f ms, "
+                    "p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+            latency->name, n, latency->lost, sum / n, samples[n / 2],
+            samples[(int) (n * 0.9)], samples[(int) (n * 0.99)], samples[n-1]);
+}
+
+/* Events injected during a replay, waiting for the X server to report them */
+#define MAX_INJECTED 256
+static struct injected {
+    int type, detail;
+    double time;
+} injected[MAX_INJECTED];
+static int ninjected = 0;
+static int measure_injected = 0;
+static struct latency inject_latency = { .name = "injection" };
+
+/* Records an event injected through XTest, when measuring. */
+static void inject_sent(int type, int detail) {
+    if (!measure_injected)
+        return;
+    if (ninjected == MAX_INJECTED) {
+        memmove(injected, injected+1, (MAX_INJECTED-1)*sizeof(*injected));
+        ninjected--;
+        inject_latency.lost++;
+    }
+    injected[ninjected].type = type;
+    injected[ninjected].detail = detail;
+    injected[ninjected].time = now_ms();
+    ninjected++;
+}
+
+/* Matches a reported event with the oldest injected one of the same type and
+ * detail, and records the delay. */
+static void inject_received(struct input_event *event) {
+    int i;
+    for (i = 0; i < ninjected; i++) {
+        if (injected[i].type == event->type &&
+                injected[i].detail == event->detail) {
+            latency_add(&inject_latency, now_ms() - injected[i].time);
+            ninjected--;
+            memmove(injected+i, injected+i+1,
+                    (ninjected-i)*sizeof(*injected));
+            return;
+        }
+    }
+}
+
+/* Mouse wheel emulation state */
+struct wheel {
+    /* Button numbers */
+    int up, down, left, right;
+    int horizontal;
+    /* Scaling factors and constant additives */
+    double xs, xc, ys, yc;
+    /* Chromium OS (aura) root window, and whether it is mapped */
+    Window aura;
+    int aura_mapped;
+    /* Accumulated scrolling */
+    double x, y;
+};
+
+/* Finds the aura root window among the children of the root window. */
+static Window find_aura(Display *display, Window root) {
+    Window root_ret, parent, *children = NULL;
+    unsigned int i, nchildren;
+    Window aura = None;
+
+    if (!XQueryTree(display, root, &root_ret, &parent, &children, &nchildren))
+        return None;
+    for (i = 0; i < nchildren && aura == None; i++) {
+        char *name = NULL;
+        if (XFetchName(display, children[i], &name) && name) {
+            if (strstr(name, "aura_root"))
+                aura = children[i];
+            XFree(name);
+        }
+    }
+    if (children)
+        XFree(children);
+    return aura;
+}
+
+/* Sends as many wheel clicks as the accumulated scrolling allows. */
+static void wheel_click(Display *display, double *acc, int neg, int pos) {
+    while (*acc >= 1) {
+        XTestFakeButtonEvent(display, pos, True, CurrentTime);
+        XTestFakeButtonEvent(display, pos, False, CurrentTime);
+        inject_sent(XI_RawButtonPress, pos);
+        *acc -= 1;
+    }
+    while (*acc <= -1) {
+        XTestFakeButtonEvent(display, neg, True, CurrentTime);
+        XTestFakeButtonEvent(display, neg, False, CurrentTime);
+        inject_sent(XI_RawButtonPress, neg);
+        *acc += 1;
+    }
+}
+
+/* Accumulates a scroll delta, reducing the acceleration of trackpads so it
+ * doesn't go crazy. Scrolling in the opposite direction resets the
+ * accumulator. */
+static void wheel_accumulate(double *acc, double delta, int trackpad,
+                             double scale, double constant) {
+    if (delta > 0) {
+        if (*acc < 0)
+            *acc = 0;
+        *acc += trackpad ? log(delta) * scale + constant : 1;
+    } else {
+        if (*acc > 0)
+            *acc = 0;
+        *acc -= trackpad ? log(-delta) * scale + constant : 1;
+    }
+}
+
+/* Reacts to raw motion events, accumulating the x and y scrolls (axes 2 and
+ * 3, or 4 and 5 on trackpads), and simulating wheel presses. */
+static void wheel_motion(Display *display, struct wheel *wheel,
+                         struct input_event *event) {
+    double *values = event->values;
+    int n = event->nvaluators;
+    double dx, dy;
+    int trackpad;
+
+    if (wheel->aura_mapped)
+        return;
+
+    /* >=10 valuators implies a trackpad */
+    if (n >= 10) {
+        dx = values[4];
+        dy = values[5];
+        trackpad = 1;
+    } else {
+        dx = n > 2 ? values[2] : NAN;
+        dy = n > 3 ? values[3] : NAN;
+        trackpad = 0;
+    }
+
+    if (wheel->horizontal && isfinite(dx) && dx != 0) {
+        wheel_accumulate(&wheel->x, dx, trackpad, wheel->xs, wheel->xc);
+        wheel_click(display, &wheel->x, wheel->left, wheel->right);
+    }
+    if (isfinite(dy) && dy != 0) {
+        wheel_accumulate(&wheel->y, dy, trackpad, wheel->ys, wheel->yc);
+        wheel_click(display, &wheel->y, wheel->up, wheel->down);
+    }
+    XFlush(display);
+}
+
+/* Disables mouse wheel events while aura is mapped (i.e. Chromium OS is
+ * in front). */
+static void wheel_map(struct wheel *wheel, struct input_event *event) {
+    if (event->window != wheel->aura)
+        return;
+    if (event->type == MapNotify) {
+        wheel->aura_mapped = 1;
+        wheel->x = 0;
+        wheel->y = 0;
+    } else {
+        wheel->aura_mapped = 0;
+    }
+}
+
+/* Feeds an event to the mouse wheel daemon. */
+static void wheel_event(Display *display, struct wheel *wheel,
+                        struct input_event *event) {
+    if (event->kind == EVENT_MAP)
+        wheel_map(wheel, event);
+    else if (event->type == XI_RawMotion)
+        wheel_motion(display, wheel, event);
+}
+
+/* Touch gestures: tracks the contacts of a touchscreen in a fixed slot table,
+ * and converts two-finger scrolling and pinching into wheel clicks and zoom
+ * (Ctrl+wheel), and swipes of three fingers or more into key presses, all
+ * injected with XTest. */
+
+#define MAX_TOUCHES 10
+#define DEFAULT_STEP 100
+/* A single touch held still for this long (ms) is not a gesture */
+#define GESTURE_HOLD 300
+
+struct gesture {
+    /* Buttons, from the wheel settings */
+    const struct wheel *wheel;
+    /* Device units per wheel click, and to recognize a gesture */
+    double step;
+    /* Contacts, as parallel arrays so that lookups only scan the ids */
+    int deviceid;
+    int ntouches;
+    uint32_t ids[MAX_TOUCHES];
+    float x[MAX_TOUCHES], y[MAX_TOUCHES];
+    enum {
+        GESTURE_NONE, GESTURE_POSSIBLE, GESTURE_SCROLL, GESTURE_PINCH,
+        GESTURE_SWIPE, GESTURE_REJECTED
+    } state;
+    /* Time of the first contact */
+    Time begin;
+    /* Centroid and spread of the contacts when they were last acted upon */
+    double cx, cy, spread;
+    /* Delay between the first contact and recognition, in server time */
+    struct latency latency;
+    /* Touches held by the grab (None if not grabbing), until the gesture is
+     * recognized or rejected, and when the first of them began (ms) */
+    Window grab_window;
+    int nheld;
+    int held_devices[MAX_TOUCHES];
+    uint32_t held[MAX_TOUCHES];
+    double held_since;
+};
+
+/* Computes the centroid of the contacts, and their mean distance to it. */
+static void gesture_shape(struct gesture *gesture,
+                          double *cx, double *cy, double *spread) {
+    int i, n = gesture->ntouches;
+    double x = 0, y = 0, d = 0;
+
+    for (i = 0; i < n; i++) {
+        x += gesture->x[i];
+        y += gesture->y[i];
+    }
+    x /= n;
+    y /= n;
+    for (i = 0; i < n; i++)
+        d += hypot(gesture->x[i] - x, gesture->y[i] - y);
+    *cx = x;
+    *cy = y;
+    *spread = d / n;
+}
+
+/* Starts recognizing again from the current contacts. */
+static void gesture_reset(struct gesture *gesture) {
+    if (gesture->ntouches == 0) {
+        gesture->state = GESTURE_NONE;
+        return;
+    }
+    if (gesture->state != GESTURE_SWIPE && gesture->state != GESTURE_REJECTED)
+        gesture->state = GESTURE_POSSIBLE;
+    gesture_shape(gesture, &gesture->cx, &gesture->cy, &gesture->spread);
+}
+
+/* Clicks a button, with Control held if zoom is set. */
+static void gesture_click(Display *display, int button, int zoom) {
+    KeyCode control = XKeysymToKeycode(display, XK_Control_L);
+    if (zoom)
+        XTestFakeKeyEvent(display, control, True, CurrentTime);
+    XTestFakeButtonEvent(display, button, True, CurrentTime);
+    XTestFakeButtonEvent(display, button, False, CurrentTime);
+    inject_sent(XI_RawButtonPress, button);
+    if (zoom)
+        XTestFakeKeyEvent(display, control, False, CurrentTime);
+}
+
+/* Types a key, with up to two modifiers (NoSymbol if not needed). */
+static void gesture_key(Display *display, KeySym mod1, KeySym mod2,
+                        KeySym key) {
+    KeyCode codes[3];
+    int i, n = 0;
+
+    if (mod1 != NoSymbol)
+        codes[n++] = XKeysymToKeycode(display, mod1);
+    if (mod2 != NoSymbol)
+        codes[n++] = XKeysymToKeycode(display, mod2);
+    codes[n++] = XKeysymToKeycode(display, key);
+    for (i = 0; i < n; i++)
+        XTestFakeKeyEvent(display, codes[i], True, CurrentTime);
+    inject_sent(XI_RawKeyPress, codes[n-1]);
+    for (i = n-1; i >= 0; i--)
+        XTestFakeKeyEvent(display, codes[i], False, CurrentTime);
+}
+
+/* Sends one click per step that *delta accumulated, in its direction. */
+static void gesture_steps(Display *display, double *delta, double step,
+                          int neg, int pos, int zoom) {
+    while (*delta >= step) {
+        gesture_click(display, pos, zoom);
+        *delta -= step;
+    }
+    while (*delta <= -step) {
+        gesture_click(display, neg, zoom);
+        *delta += step;
+    }
+}
+
+/* Recognizes the gesture once the contacts moved by a step, and acts on the
+ * recognized gesture. */
+static void gesture_update(Display *display, struct gesture *gesture,
+                           Time time) {
+    const struct wheel *wheel = gesture->wheel;
+    double cx, cy, spread, dx, dy, dspread;
+
+    gesture_shape(gesture, &cx, &cy, &spread);
+    dx = cx - gesture->cx;
+    dy = cy - gesture->cy;
+    dspread = spread - gesture->spread;
+
+    if (gesture->state == GESTURE_POSSIBLE) {
+        if (gesture->ntouches == 2 && fabs(dspread) >= gesture->step) {
+            gesture->state = GESTURE_PINCH;
+        } else if (hypot(dx, dy) >= gesture->step) {
+            if (gesture->ntouches == 2)
+                gesture->state = GESTURE_SCROLL;
+            else if (gesture->ntouches >= 3)
+                gesture->state = GESTURE_SWIPE;
+            else
+                gesture->state = GESTURE_REJECTED;
+        }
+        if (gesture->state == GESTURE_POSSIBLE ||
+                gesture->state == GESTURE_REJECTED)
+            return;
+        latency_add(&gesture->latency, (uint32_t) (time - gesture->begin));
+        if (gesture->state == GESTURE_SWIPE) {
+            /* Once per gesture: back/forward, or switch workspace */
+            if (fabs(dx) >= fabs(dy))
+                gesture_key(display, XK_Alt_L, NoSymbol,
+                            dx > 0 ? XK_Left : XK_Right);
+            else
+                gesture_key(display, XK_Control_L, XK_Alt_L,
+                            dy > 0 ? XK_Up : XK_Down);
+            return;
+        }
+    }
+
+    if (gesture->state == GESTURE_SCROLL) {
+        /* The content follows the fingers */
+        gesture_steps(display, &dy, gesture->step, wheel->down, wheel->up, 0);
+        if (wheel->horizontal)
+            gesture_steps(display, &dx, gesture->step,
+                          wheel->right, wheel->left, 0);
+        gesture->cx = cx - dx;
+        gesture->cy = cy - dy;
+    } else if (gesture->state == GESTURE_PINCH) {
+        /* Spreading the fingers zooms in */
+        gesture_steps(display, &dspread, gesture->step,
+                      wheel->down, wheel->up, 1);
+        gesture->spread = spread - dspread;
+    }
+}
+
+/* Accepts the held touches once a gesture is recognized, or rejects them, so
+ * that they are replayed to the clients, once they cannot be one. */
+static void gesture_allow(Display *display, struct gesture *gesture) {
+    int i, mode;
+
+    if (gesture->nheld == 0)
+        return;
+    if (gesture->state == GESTURE_REJECTED)
+        mode = XIRejectTouch;
+    else if (gesture->state == GESTURE_SCROLL ||
+             gesture->state == GESTURE_PINCH ||
+             gesture->state == GESTURE_SWIPE)
+        mode = XIAcceptTouch;
+    else
+        return;
+    for (i = 0; i < gesture->nheld; i++)
+        XIAllowTouchEvents(display, gesture->held_devices[i], gesture->held[i],
+                           gesture->grab_window, mode);
+    gesture->nheld = 0;
+    XFlush(display);
+}
+
+/* Grabs the touches on the root window, so that their pointer emulation does
+ * not reach the clients before the gesture is recognized. */
+static void gesture_grab(Display *display, Window root,
+                         struct gesture *gesture) {
+    XIEventMask eventmask;
+    unsigned char ximask[XIMaskLen(XI_LASTEVENT)];
+    XIGrabModifiers modifiers = { .modifiers = XIAnyModifier };
+
+    memset(ximask, 0, sizeof(ximask));
+    XISetMask(ximask, XI_TouchBegin);
+    XISetMask(ximask, XI_TouchUpdate);
+    XISetMask(ximask, XI_TouchEnd);
+    eventmask.deviceid = XIAllMasterDevices;
+    eventmask.mask = ximask;
+    eventmask.mask_len = sizeof(ximask);
+    if (XIGrabTouchBegin(display, XIAllMasterDevices, root, False,
+                         &eventmask, 1, &modifiers) != 0) {
+        fprintf(stderr, "Cannot grab touches, gestures will also reach "
+                        "the clients.\n");
+        return;
+    }
+    gesture->grab_window = root;
+}
+
+/* Holds the touches delivered by the grab until they are accepted or
+ * rejected. A touch that ends while still held was not part of a gesture. */
+static void gesture_grabbed(Display *display, struct gesture *gesture,
+                            XIDeviceEvent *event) {
+    int i;
+
+    for (i = 0; i < gesture->nheld; i++) {
+        if (gesture->held[i] == event->detail &&
+                gesture->held_devices[i] == event->deviceid)
+            break;
+    }
+    if (event->evtype == XI_TouchBegin && i == gesture->nheld) {
+        if (i == MAX_TOUCHES) {
+            XIAllowTouchEvents(display, event->deviceid, event->detail,
+                               gesture->grab_window, XIRejectTouch);
+            return;
+        }
+        if (i == 0)
+            gesture->held_since = now_ms();
+        gesture->held_devices[i] = event->deviceid;
+        gesture->held[i] = event->detail;
+        gesture->nheld++;
+    } else if (event->evtype == XI_TouchEnd && i < gesture->nheld) {
+        XIAllowTouchEvents(display, event->deviceid, event->detail,
+                           gesture->grab_window, XIRejectTouch);
+        gesture->nheld--;
+        gesture->held_devices[i] = gesture->held_devices[gesture->nheld];
+        gesture->held[i] = gesture->held[gesture->nheld];
+    }
+    gesture_allow(display, gesture);
+}
+
+/* Rejects a single touch held still (e.g. a long press, or the start of a
+ * drag), and returns the time until that can happen in ms, or -1. */
+static int gesture_timeout(Display *display, struct gesture *gesture) {
+    if (gesture->nheld == 0 || gesture->state != GESTURE_POSSIBLE ||
+            gesture->ntouches != 1)
+        return -1;
+    double now = now_ms();
+    if (now >= gesture->held_since + GESTURE_HOLD) {
+        gesture->state = GESTURE_REJECTED;
+        gesture_allow(display, gesture);
+        return -1;
+    }
+    return gesture->held_since + GESTURE_HOLD - now + 1;
+}
+
+/* Tracks touch events from one device at a time. */
+static void gesture_touch(Display *display, struct gesture *gesture,
+                          struct input_event *event) {
+    int i;
+
+    if (gesture->ntouches > 0 && event->deviceid != gesture->deviceid)
+        return;
+    for (i = 0; i < gesture->ntouches; i++) {
+        if (gesture->ids[i] == event->detail)
+            break;
+    }
+
+    switch (event->type) {
+    case XI_RawTouchBegin:
+        if (i < gesture->ntouches || i == MAX_TOUCHES ||
+                event->nvaluators < 2)
+            return;
+        if (i == 0) {
+            gesture->deviceid = event->deviceid;
+            gesture->begin = event->time;
+        }
+        gesture->ids[i] = event->detail;
+        gesture->x[i] = event->values[0];
+        gesture->y[i] = event->values[1];
+        gesture->ntouches++;
+        gesture_reset(gesture);
+        break;
+    case XI_RawTouchUpdate:
+        if (i == gesture->ntouches)
+            return;
+        if (event->nvaluators > 0 && isfinite(event->values[0]))
+            gesture->x[i] = event->values[0];
+        if (event->nvaluators > 1 && isfinite(event->values[1]))
+            gesture->y[i] = event->values[1];
+        gesture_update(display, gesture, event->time);
+        gesture_allow(display, gesture);
+        break;
+    case XI_RawTouchEnd:
+        if (i == gesture->ntouches)
+            return;
+        /* Lifted before moving, e.g. a tap: let the clients have it */
+        if (gesture->state == GESTURE_POSSIBLE)
+            gesture->state = GESTURE_REJECTED;
+        gesture_allow(display, gesture);
+        /* Move the last contact to the free slot */
+        gesture->ntouches--;
+        gesture->ids[i] = gesture->ids[gesture->ntouches];
+        gesture->x[i] = gesture->x[gesture->ntouches];
+        gesture->y[i] = gesture->y[gesture->ntouches];
+        gesture_reset(gesture);
+        break;
+    }
+}
+
+/* Idle monitor: pings Chromium OS's powerd when there is user activity,
+ * through the D-Bus bridge (croutondbus -d), over a persistent connection to
+ * its control socket. If the bridge is not running, croutondbus ping is run
+ * instead: it connects to the bus directly. */
+
+#define BRIDGE_SOCKET "/tmp/crouton-dbus"
+
+static int bridge_fd = -1;
+
+/* Discards the replies of the bridge, and notices it exiting. */
+static void bridge_drain() {
+    char buffer[64];
+    int n = recv(bridge_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        close(bridge_fd);
+        bridge_fd = -1;
+    }
+}
+
+/* Tells powerd that the user is active, reconnecting once if needed. */
+static void ping_powerd() {
+    int retry;
+    for (retry = 0; retry < 2; retry++) {
+        if (bridge_fd < 0 &&
+                (bridge_fd = socket_connect(BRIDGE_SOCKET, SOCK_SEQPACKET)) < 0)
+            break;
+        if (send(bridge_fd, "ping", 4, MSG_NOSIGNAL) == 4)
+            return;
+        close(bridge_fd);
+        bridge_fd = -1;
+    }
+    /* No bridge: children are reaped automatically (SIGCHLD is ignored) */
+    if (fork() == 0) {
+        execlp("croutondbus", "croutondbus", "ping", (char *) NULL);
+        _exit(127);
+    }
+}
+
+/* Idle monitor state */
+struct idle {
+    /* Minimum interval between pings, in ms */
+    double interval;
+    /* Time of the last input event, and of the last ping */
+    double last_input, last_ping;
+};
+
+/* Records user activity, and pings powerd right away, unless it was pinged
+ * less than interval ago. */
+static void idle_input(struct idle *idle) {
+    idle->last_input = now_ms();
+    if (idle->last_input >= idle->last_ping + idle->interval) {
+        ping_powerd();
+        idle->last_ping = idle->last_input;
+    }
+}
+
+/* Pings powerd if there was activity since the last (rate-limited) ping, and
+ * returns the time until that can happen in ms, or -1 if there is none. */
+static int idle_timeout(struct idle *idle) {
+    if (idle->last_input <= idle->last_ping)
+        return -1;
+    double now = now_ms();
+    if (now >= idle->last_ping + idle->interval) {
+        ping_powerd();
+        idle->last_ping = now;
+        return -1;
+    }
+    return idle->last_ping + idle->interval - now + 1;
+}
+
+/* Event hub: a single X11 connection and XI2 subscription, whose events are
+ * published to local subscribers over a UNIX socket, so that the various
+ * monitors do not each keep their own connection and wake-ups.
+ *
+ * A subscriber connects to the hub socket and sends its event mask (uint32),
+ * and may send a new one at any time. The hub selects the union of the masks
+ * of all subscribers, and sends each of them the matching events, one record
+ * per packet: a struct hub_record, followed, for raw events, by the set
+ * valuators as floats, or, for map events, by the window name. Records are
+ * dropped if a subscriber does not keep up. */
+
+#define HUB_SOCKET "/tmp/crouton-xi2event-%d"
+#define HUB_PATH_SIZE 64
+#define MAX_SUBSCRIBERS 16
+#define MAX_RECORD (sizeof(struct hub_record) + MAX_VALUATORS*sizeof(float))
+
+struct hub_record {
+    uint8_t kind, type, nvaluators;
+    uint8_t flag; /* Override-redirect map events, absolute motion events */
+    uint32_t time;
+    uint16_t deviceid, sourceid;
+    uint32_t detail; /* Detail of raw events, window of map events */
+    uint32_t valuators; /* Mask of the valuators that follow */
+};
+
+static struct subscriber {
+    int fd;
+    uint32_t mask;
+} subscribers[MAX_SUBSCRIBERS];
+static int nsubscribers = 0;
+
+/* Fills path (of size HUB_PATH_SIZE) with the hub socket of the current
+ * display. Returns -1 if the display name cannot be parsed. */
+static int hub_path(char *path) {
+    const char *colon = strrchr(XDisplayName(NULL), ':');
+    if (!colon || colon[1] < '0' || colon[1] > '9')
+        return -1;
+    snprintf(path, HUB_PATH_SIZE, HUB_SOCKET, atoi(colon+1));
+    return 0;
+}
+
+/* Creates the hub socket. Returns the listening socket, -2 if another hub is
+ * already running for this display, or -1 on error. */
+static int hub_listen() {
+    char path[HUB_PATH_SIZE];
+
+    if (hub_path(path) < 0) {
+        fprintf(stderr, "Invalid display name %s\n", XDisplayName(NULL));
+        return -1;
+    }
+    return socket_listen(path, SOCK_SEQPACKET, 8);
+}
+
+/* Returns the union of the masks of all subscribers. */
+static uint32_t hub_mask() {
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < nsubscribers; i++)
+        mask |= subscribers[i].mask;
+    return mask;
+}
+
+/* Accepts a new subscriber. It receives nothing until it sends its mask. */
+static void hub_accept(int listen_fd) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (nsubscribers == MAX_SUBSCRIBERS) {
+        fprintf(stderr, "Too many subscribers.\n");
+        close(fd);
+        return;
+    }
+    subscribers[nsubscribers].fd = fd;
+    subscribers[nsubscribers].mask = 0;
+    nsubscribers++;
+}
+
+static void hub_remove(int i) {
+    close(subscribers[i].fd);
+    subscribers[i] = subscribers[--nsubscribers];
+}
+
+/* Reads a new mask from subscriber i, removing it if it went away. */
+static void hub_read(int i) {
+    uint32_t mask;
+    int n = recv(subscribers[i].fd, &mask, sizeof(mask), MSG_DONTWAIT);
+    if (n == sizeof(mask))
+        subscribers[i].mask = mask;
+    else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        hub_remove(i);
+}
+
+/* Encodes an event into buffer (at least MAX_RECORD bytes long). Returns the
+ * length of the record. */
+static int hub_encode(struct input_event *event, char *buffer) {
+    struct hub_record *record = (struct hub_record *) buffer;
+    float *values = (float *) (record + 1);
+    int i, len;
+
+    memset(record, 0, sizeof(*record));
+    record->kind = event->kind;
+    record->type = event->type;
+    record->time = event->time;
+    if (event->kind == EVENT_MAP) {
+        record->detail = event->window;
+        record->flag = event->override_redirect;
+        len = strlen(event->name);
+        if (len > MAX_RECORD - sizeof(*record))
+            len = MAX_RECORD - sizeof(*record);
+        memcpy(record + 1, event->name, len);
+        return sizeof(*record) + len;
+    }
+    record->deviceid = event->deviceid;
+    record->sourceid = event->sourceid;
+    record->detail = event->detail;
+    record->flag = event->absolute;
+    record->nvaluators = event->nvaluators;
+    len = 0;
+    for (i = 0; i < event->nvaluators; i++) {
+        if (!isnan(event->values[i])) {
+            record->valuators |= 1u << i;
+            values[len++] = event->values[i];
+        }
+    }
+    return sizeof(*record) + len*sizeof(float);
+}
+
+/* Decodes a record of length len into event. Returns 0 on success. */
+static int hub_decode(char *buffer, int len, struct input_event *event) {
+    struct hub_record *record = (struct hub_record *) buffer;
+    float *values = (float *) (record + 1);
+    int i, n = 0;
+
+    if (len < sizeof(*record))
+        return -1;
+    len -= sizeof(*record);
+    event->kind = record->kind;
+    event->type = record->type;
+    event->time = record->time;
+    if (record->kind == EVENT_MAP) {
+        if (len >= MAX_NAME)
+            len = MAX_NAME-1;
+        event->window = record->detail;
+        event->override_redirect = record->flag;
+        memcpy(event->name, record + 1, len);
+        event->name[len] = '\0';
+        return 0;
+    }
+    if (record->nvaluators > MAX_VALUATORS)
+        return -1;
+    event->deviceid = record->deviceid;
+    event->sourceid = record->sourceid;
+    event->detail = record->detail;
+    event->absolute = record->flag;
+    event->nvaluators = record->nvaluators;
+    for (i = 0; i < event->nvaluators; i++) {
+        if (record->valuators & (1u << i)) {
+            if ((n+1)*sizeof(float) > len)
+                return -1;
+            event->values[i] = values[n++];
+        } else {
+            event->values[i] = NAN;
+        }
+    }
+    return 0;
+}
+
+/* Returns the mask bit matching an event. */
+static uint32_t event_mask(struct input_event *event) {
+    return event->kind == EVENT_MAP ? EVENT_MASK_MAP
+                                    : EVENT_MASK_RAW(event->type);
+}
+
+/* Sends an event to the interested subscribers, without blocking. */
+static void hub_publish(struct input_event *event) {
+    char buffer[MAX_RECORD];
+    uint32_t bit = event_mask(event);
+    int i, len = 0;
+
+    for (i = nsubscribers-1; i >= 0; i--) {
+        if (!(subscribers[i].mask & bit))
+            continue;
+        if (!len)
+            len = hub_encode(event, buffer);
+        if (send(subscribers[i].fd, buffer, len,
+                 MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+                errno != EAGAIN && errno != EINTR)
+            hub_remove(i);
+    }
+}
+
+/* Connects to the hub of the current display, and subscribes to the events in
+ * mask. Returns the socket, or -1 if no hub is running. */
+static int hub_subscribe(uint32_t mask) {
+    char path[HUB_PATH_SIZE];
+    int fd;
+
+    if (hub_path(path) < 0 ||
+            (fd = socket_connect(path, SOCK_SEQPACKET)) < 0)
+        return -1;
+    if (send(fd, &mask, sizeof(mask), MSG_NOSIGNAL) != sizeof(mask)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Traces: a trace file starts with TRACE_MAGIC, followed, for each event, by
+ * a struct trace_entry and a hub record (see above). The X server time of
+ * the event is in the record, the time it was received in the entry. */
+
+#define TRACE_MAGIC "XI2TRACE"
+
+struct trace_entry {
+    uint64_t received; /* CLOCK_MONOTONIC time, in us */
+    uint32_t length; /* Length of the record that follows */
+    uint32_t reserved;
+};
+
+/* Writes an event to the trace, and records how long it took to get here
+ * since the X server timestamped it. The X server time is CLOCK_MONOTONIC in
+ * ms on Linux: samples that do not make sense are not counted. */
+static int trace_write(FILE *trace, struct input_event *event,
+                       struct latency *latency) {
+    char record[MAX_RECORD];
+    struct trace_entry entry;
+    double now = now_ms();
+
+    memset(&entry, 0, sizeof(entry));
+    entry.received = now * 1000;
+    entry.length = hub_encode(event, record);
+    if (fwrite(&entry, sizeof(entry), 1, trace) != 1 ||
+            fwrite(record, entry.length, 1, trace) != 1) {
+        perror("Cannot write trace");
+        return -1;
+    }
+    if (event->time != CurrentTime) {
+        /* Server time wraps around every 49 days */
+        int32_t delay = (uint32_t) (uint64_t) now - (uint32_t) event->time;
+        if (delay >= 0 && delay < 60000)
+            latency_add(latency, delay + (now - floor(now)));
+    }
+    return 0;
+}
+
+/* Replay state */
+struct replay {
+    FILE *file;
+    /* Next entry, and its record */
+    struct trace_entry entry;
+    char record[MAX_RECORD];
+    int pending;
+    /* Receive time of the first entry, and when it was replayed, in ms */
+    double first, start;
+    /* When the end of the trace was reached */
+    double end;
+    /* Fractional relative motion not injected yet */
+    double x, y;
+};
+
+/* Opens a trace for replay. Returns 0 on success. */
+static int replay_open(struct replay *replay, const char *name) {
+    char magic[sizeof(TRACE_MAGIC)-1];
+
+    memset(replay, 0, sizeof(*replay));
+    if (!(replay->file = fopen(name, "rb"))) {
+        perror("Cannot open trace");
+        return -1;
+    }
+    if (fread(magic, sizeof(magic), 1, replay->file) != 1 ||
+            memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "%s is not a trace.\n", name);
+        fclose(replay->file);
+        return -1;
+    }
+    replay->end = -1;
+    return 0;
+}
+
+/* Gets the next event of the trace if it is due, at the original pacing.
+ * Returns 0 if event was filled, the time to wait for the next one in ms, or
+ * -1 when the replay is over: the end of the trace was reached, and all the
+ * injected events were reported (or one second passed). */
+static int replay_next(struct replay *replay, struct input_event *event) {
+    double now = now_ms();
+
+    while (!replay->pending && replay->end < 0) {
+        struct trace_entry *entry = &replay->entry;
+        if (fread(entry, sizeof(*entry), 1, replay->file) != 1 ||
+                entry->length > MAX_RECORD ||
+                fread(replay->record, entry->length, 1, replay->file) != 1) {
+            replay->end = now;
+            break;
+        }
+        if (hub_decode(replay->record, entry->length, event) < 0)
+            continue;
+        if (replay->start == 0) {
+            replay->first = entry->received / 1000.0;
+            replay->start = now;
+        }
+        replay->pending = 1;
+    }
+    if (replay->end >= 0) {
+        if (ninjected == 0 || now >= replay->end + 1000)
+            return -1;
+        return replay->end + 1000 - now + 1;
+    }
+
+    double due = replay->start + replay->entry.received / 1000.0 -
+                 replay->first;
+    if (due > now)
+        return due - now + 1;
+    hub_decode(replay->record, replay->entry.length, event);
+    replay->pending = 0;
+    return 0;
+}
+
+/* Injects a replayed event through XTest. Motion is injected as relative
+ * pointer motion, from valuators 0 and 1; touch events are not replayed. */
+static void replay_inject(Display *display, struct replay *replay,
+                          struct input_event *event) {
+    int dx, dy;
+
+    switch (event->type) {
+    case XI_RawKeyPress:
+    case XI_RawKeyRelease:
+        XTestFakeKeyEvent(display, event->detail,
+                          event->type == XI_RawKeyPress, CurrentTime);
+        break;
+    case XI_RawButtonPress:
+    case XI_RawButtonRelease:
+        XTestFakeButtonEvent(display, event->detail,
+                             event->type == XI_RawButtonPress, CurrentTime);
+        break;
+    case XI_RawMotion:
+        if (event->nvaluators > 0 && isfinite(event->values[0]))
+            replay->x += event->values[0];
+        if (event->nvaluators > 1 && isfinite(event->values[1]))
+            replay->y += event->values[1];
+        dx = replay->x;
+        dy = replay->y;
+        if (dx == 0 && dy == 0)
+            return;
+        replay->x -= dx;
+        replay->y -= dy;
+        XTestFakeRelativeMotionEvent(display, dx, dy, CurrentTime);
+        event->detail = 0;
+        break;
+    default:
+        return;
+    }
+    inject_sent(event->type, event->detail);
 }
 
 void usage(char* argv0) {
-    fprintf(stderr, "%s [-1]\n", argv0);
+    fprintf(stderr, "%s [-S] [-1] [-t types] [-v valuators] [-M] [-m ms] "
+                    "[-f ms]\n", argv0);
+    fprintf(stderr, "%s [-S] -w [-x] [-r] [-a #.#] [-b #.#] [-c #.#] "
+                    "[-d #.#]\n", argv0);
+    fprintf(stderr, "%s -g [-x] [-r] [-u units]\n", argv0);
+    fprintf(stderr, "%s [-S] -i seconds\n", argv0);
+    fprintf(stderr, "%s -s\n", argv0);
+    fprintf(stderr, "%s [-S] -R trace [-t types] [-M]\n", argv0);
+    fprintf(stderr, "%s [-w ...|-g ...] -P trace\n", argv0);
     fprintf(stderr, "   Monitors and displays XInput 2 raw events.\n");
     fprintf(stderr, "   -1: only wait for one event, then exit.\n");
+    fprintf(stderr, "   -t: comma-separated list of raw event types to\n"
+                    "       report (13-17, 22-24; may be empty).\n");
+    fprintf(stderr, "   -v: comma-separated list of valuators to report\n"
+                    "       (others are reported as nan).\n");
+    fprintf(stderr, "   -M: also report top-level windows being mapped and\n"
+                    "       unmapped, with their name.\n");
+    fprintf(stderr, "   -m: merge consecutive relative motion events within\n"
+                    "       a time window, summing their valuators (motion\n"
+                    "       of absolute devices is not merged).\n");
+    fprintf(stderr, "   -f: flush the output in batches, at most every ms.\n");
+    fprintf(stderr, "   -S: receive events from the hub of the display if it\n"
+                    "       is running, instead of connecting to X11 (the\n"
+                    "       mouse wheel daemon still connects to inject\n"
+                    "       clicks, without selecting events).\n");
+    fprintf(stderr, "   -s: event hub: publishes events to the subscribers.\n");
+    fprintf(stderr, "   -w: mouse wheel daemon: converts scrolling into wheel\n"
+                    "       clicks, unless Chromium OS is in front.\n");
+    fprintf(stderr, "   Mouse wheel daemon options:\n");
+    fprintf(stderr, "   -r: reverse the direction of scrolling.\n");
+    fprintf(stderr, "   -x: disable horizontal scrolling.\n");
+    fprintf(stderr, "   -a: X scrolling scaling factor (default: 0.2).\n");
+    fprintf(stderr, "   -b: X scrolling constant additive (default: 0.01).\n");
+    fprintf(stderr, "   -c: Y scrolling scaling factor (default: 0.2).\n");
+    fprintf(stderr, "   -d: Y scrolling constant additive (default: 0.05).\n");
+    fprintf(stderr, "   -g: gesture recognizer: two-finger scrolling and\n"
+                    "       pinching (zoom), and three-finger swipes (left,\n"
+                    "       right: back, forward; up, down: workspace).\n");
+    fprintf(stderr, "   Gesture recognizer options (and -r, -x):\n");
+    fprintf(stderr, "   -u: touchscreen units per wheel click (default: %d).\n",
+            DEFAULT_STEP);
+    fprintf(stderr, "   -i: idle monitor: pings powerd on input events, at\n"
+                    "       most once every given number of seconds.\n");
+    fprintf(stderr, "   -R: record events to a trace, until interrupted, and\n"
+                    "       report the delay since the X server got them.\n");
+    fprintf(stderr, "   -P: replay a trace with XTest, at the original pace,\n"
+                    "       or feed it to the mouse wheel daemon (-w) or the\n"
+                    "       gesture recognizer (-g), and report the delay\n"
+                    "       until the X server reports the injected events.\n");
     exit(1);
 }
 
-int main(int argc, char *argv[]) {
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt_handler(int signum) {
+    interrupted = 1;
+}
+
+/* Connects to the X server, and checks for the XInput extension. */
+static Display *open_display(int *xi_opcode) {
     int firstev, firsterr;
+    Display *display = XOpenDisplay(NULL);
+
+    if (display == NULL) {
+        fprintf(stderr, "Unable to connect to X server\n");
+        exit(1);
+    }
+
+    if (!XQueryExtension(display, "XInputExtension",
+                         xi_opcode, &firstev, &firsterr)) {
+        fprintf(stderr, "X Input extension not available.\n");
+        exit(1);
+    }
+    /* Touch events are only sent to XI 2.2 clients */
+    int major = 2, minor = 2;
+    XIQueryVersion(display, &major, &minor);
+    xi_bad_device = firsterr + XI_BadDevice;
+    XSetErrorHandler(error_handler);
+    return display;
+}
+
+int main(int argc, char *argv[]) {
     int xi_opcode = -1;
     int one_event = 0;
+    enum {
+        MODE_PRINT, MODE_WHEEL, MODE_GESTURE, MODE_IDLE, MODE_HUB,
+        MODE_RECORD, MODE_REPLAY
+    } mode = MODE_PRINT;
+    int subscribe = 0;
     int terminate = 0;
-
-    /* stdout: line buffering */
-    setvbuf(stdout, NULL, _IOLBF, 0);
+    struct wheel wheel = {
+        .up = 4, .down = 5, .left = 6, .right = 7, .horizontal = 1,
+        .xs = 0.2, .xc = 0.01, .ys = 0.2, .yc = 0.05,
+    };
+    struct gesture gesture = {
+        .wheel = &wheel, .step = DEFAULT_STEP,
+        .latency = { .name = "recognition" },
+    };
+    struct idle idle = { .last_input = -1, .last_ping = -1e12 };
+    uint32_t mask = 0;
+    int type_filter = 0;
+    int map_events = 0;
+    double last_flush = 0;
+    int listen_fd = -1, hub_fd = -1;
+    char *record_name = NULL, *replay_name = NULL;
+    FILE *trace = NULL;
+    struct replay replay = { .file = NULL };
+    struct latency record_latency = { .name = "receive" };
+    int c, i, tmp;
 
     /* Parse arguments */
-    if (argc == 2) {
-        printf("%s", argv[1]);
-        if (strcmp(argv[1], "-1") == 0)
-            one_event = 1;
-        else
+    while ((c = getopt(argc, argv, "1t:v:Mm:f:sSwgu:xra:b:c:d:i:R:P:")) != -1) {
+        switch (c) {
+        case '1': one_event = 1; break;
+        case 't':
+            type_filter = 1;
+            if (parse_list(optarg, &mask, 31) < 0 ||
+                    (mask & ~raw_types_mask()))
+                usage(argv[0]);
+            break;
+        case 'v':
+            valuator_filter = 1;
+            if (parse_list(optarg, &valuator_mask, MAX_VALUATORS) < 0)
+                usage(argv[0]);
+            break;
+        case 'M': map_events = 1; break;
+        case 'm': merge_window = atoi(optarg); break;
+        case 'f': flush_interval = atoi(optarg); break;
+        case 'S': subscribe = 1; break;
+        case 's':
+        case 'w':
+        case 'g':
+            if (mode != MODE_PRINT)
+                usage(argv[0]);
+            mode = c == 's' ? MODE_HUB : c == 'w' ? MODE_WHEEL : MODE_GESTURE;
+            break;
+        case 'u':
+            gesture.step = atof(optarg);
+            if (gesture.step <= 0)
+                usage(argv[0]);
+            break;
+        case 'i':
+            if (mode != MODE_PRINT)
+                usage(argv[0]);
+            mode = MODE_IDLE;
+            idle.interval = atof(optarg) * 1000;
+            break;
+        case 'R':
+            if (mode != MODE_PRINT)
+                usage(argv[0]);
+            mode = MODE_RECORD;
+            record_name = optarg;
+            break;
+        case 'P': replay_name = optarg; break;
+        case 'x': wheel.horizontal = 0; break;
+        case 'r':
+            tmp = wheel.up; wheel.up = wheel.down; wheel.down = tmp;
+            tmp = wheel.left; wheel.left = wheel.right; wheel.right = tmp;
+            break;
+        case 'a': wheel.xs = atof(optarg); break;
+        case 'b': wheel.xc = atof(optarg); break;
+        case 'c': wheel.ys = atof(optarg); break;
+        case 'd': wheel.yc = atof(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (replay_name) {
+        if (mode == MODE_PRINT)
+            mode = MODE_REPLAY;
+        else if (mode != MODE_WHEEL && mode != MODE_GESTURE)
             usage(argv[0]);
-    } else if (argc > 2) {
+    }
+    if (optind < argc || (one_event && mode != MODE_PRINT) ||
+            (subscribe && mode != MODE_PRINT && mode != MODE_IDLE &&
+                          mode != MODE_RECORD && mode != MODE_WHEEL) ||
+            (subscribe && replay_name))
         usage(argv[0]);
+    /* Merging is pointless when waiting for a single event */
+    if (one_event)
+        merge_window = 0;
+
+    /* Only select the requested event types, so that the X server (or the
+     * hub) does not even send the others. */
+    if (replay_name) {
+        /* Only the events that are injected, to measure the delay */
+        mask = EVENT_MASK_RAW(XI_RawButtonPress);
+        if (mode == MODE_GESTURE)
+            mask |= EVENT_MASK_RAW(XI_RawKeyPress);
+        if (mode == MODE_REPLAY) {
+            mask |= EVENT_MASK_RAW(XI_RawKeyPress) |
+                    EVENT_MASK_RAW(XI_RawKeyRelease) |
+                    EVENT_MASK_RAW(XI_RawButtonRelease) |
+                    EVENT_MASK_RAW(XI_RawMotion);
+        }
+    } else if (mode == MODE_WHEEL) {
+        /* The mouse wheel daemon only needs motion and map events */
+        mask = EVENT_MASK_RAW(XI_RawMotion) | EVENT_MASK_MAP;
+    } else if (mode == MODE_GESTURE) {
+        mask = EVENT_MASK_RAW(XI_RawTouchBegin) |
+               EVENT_MASK_RAW(XI_RawTouchUpdate) |
+               EVENT_MASK_RAW(XI_RawTouchEnd);
+    } else if (mode == MODE_HUB) {
+        /* Nothing until there are subscribers */
+        mask = 0;
+    } else {
+        if (!type_filter)
+            mask = raw_types_mask();
+        if (map_events)
+            mask |= EVENT_MASK_MAP;
     }
 
-    Display* display = XOpenDisplay(NULL);
+    /* stdout: line buffering, or full buffering if flushed in batches */
+    if (flush_interval > 0)
+        setvbuf(stdout, NULL, _IOFBF, 65536);
+    else
+        setvbuf(stdout, NULL, _IOLBF, 0);
 
-    if (display == NULL) {
-        fprintf(stderr, "Unable to connect to X server\n");
-        exit(1);
+    if (record_name) {
+        if (!(trace = fopen(record_name, "wb")) ||
+                fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC)-1, 1, trace) != 1) {
+            perror("Cannot create trace");
+            return 1;
+        }
+    } else if (replay_name) {
+        if (replay_open(&replay, replay_name) < 0)
+            return 1;
+        measure_injected = 1;
+    }
+    if (trace || replay.file) {
+        /* Stop cleanly to report the delays */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = interrupt_handler;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
     }
 
-    if (!XQueryExtension(display, "XInputExtension",
-                         &xi_opcode, &firstev, &firsterr)) {
-        fprintf(stderr, "X Input extension not available.\n");
-        exit(1);
+    /* The idle monitor does not wait for the commands it runs */
+    if (mode == MODE_IDLE)
+        signal(SIGCHLD, SIG_IGN);
+
+    if (mode == MODE_HUB) {
+        listen_fd = hub_listen();
+        if (listen_fd == -2) {
+            fprintf(stderr, "A hub is already running on this display.\n");
+            return 0;
+        } else if (listen_fd < 0) {
+            return 1;
+        }
     }
 
+    Display *display = NULL;
+    if (subscribe)
+        hub_fd = hub_subscribe(mask);
+    if (hub_fd < 0)
+        display = open_display(&xi_opcode);
+
     /* Listen on root window so that we do not need to create our own. */
-    Window win = DefaultRootWindow(display);
+    Window win = display ? DefaultRootWindow(display) : None;
 
-    XIEventMask eventmask;
+    /* Events are injected on the X11 connection, or, if events come from the
+     * hub, on a connection of its own, which does not select any event. */
+    Display *xtest = NULL;
+    if (mode == MODE_WHEEL || mode == MODE_GESTURE || mode == MODE_REPLAY) {
+        int ev, err, major, minor;
+        xtest = display ? display : open_display(&xi_opcode);
+        if (!XTestQueryExtension(xtest, &ev, &err, &major, &minor)) {
+            fprintf(stderr, "XTest extension not available.\n");
+            exit(1);
+        }
+        /* Use map events to detect when the aura window comes to front. */
+        if (mode == MODE_WHEEL)
+            wheel.aura = find_aura(xtest, DefaultRootWindow(xtest));
+    }
 
-    eventmask.deviceid = XIAllMasterDevices;
-    unsigned char mask[XIMaskLen(XI_LASTEVENT)];
-    memset(mask, 0, sizeof(mask));
-    XISetMask(mask, XI_RawKeyPress);
-    XISetMask(mask, XI_RawKeyRelease);
-    XISetMask(mask, XI_RawButtonPress);
-    XISetMask(mask, XI_RawButtonRelease);
-    XISetMask(mask, XI_RawMotion);
-    XISetMask(mask, XI_RawTouchBegin);
-    XISetMask(mask, XI_RawTouchUpdate);
-    XISetMask(mask, XI_RawTouchEnd);
-    eventmask.mask = mask;
-    eventmask.mask_len = sizeof(mask);
-
-    /* select on the window */
-    XISelectEvents(display, win, &eventmask, 1);
-
-    XEvent event;
-    XGenericEventCookie *cookie = &event.xcookie;
-
-    while (!terminate) {
-        XNextEvent(display, &event);
-
-        if (XGetEventData(display, cookie)) {
-            if (cookie->extension == xi_opcode && cookie->type == GenericEvent) {
-                switch(cookie->evtype) {
-                case XI_RawKeyPress:
-                case XI_RawKeyRelease:
-                case XI_RawButtonPress:
-                case XI_RawButtonRelease:
-                case XI_RawMotion:
-                case XI_RawTouchBegin:
-                case XI_RawTouchUpdate:
-                case XI_RawTouchEnd:
-                    print_rawevent(cookie->data);
-                    if (one_event)
-                        terminate = 1;
-                    break;
-                default:
-                    break;
+    if (display)
+        select_events(display, win, mask);
+    if (mode == MODE_GESTURE && !replay_name)
+        gesture_grab(display, win, &gesture);
+
+    XEvent xevent;
+    XGenericEventCookie *cookie = &xevent.xcookie;
+    struct input_event event;
+    char record[MAX_RECORD];
+    int have_event;
+
+    /* Poll array:
+     * 0 - X11 connection, or hub connection
+     * 1 - D-Bus bridge connection (idle monitor mode, if connected)
+     * 2 - Hub socket (hub mode)
+     * 3+ - Subscribers (hub mode)
+     */
+    struct pollfd fds[3+MAX_SUBSCRIBERS];
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+    fds[2].fd = listen_fd;
+    fds[2].events = POLLIN;
+
+    while (!terminate && !interrupted) {
+        /* Print merged motion events and flush the output when they are due,
+         * even if events keep coming. Wait for events until the next one. */
+        int timeout = flush_output(&last_flush);
+        if (mode == MODE_IDLE) {
+            int idle_wait = idle_timeout(&idle);
+            if (timeout < 0 || (idle_wait >= 0 && idle_wait < timeout))
+                timeout = idle_wait;
+        }
+        if (mode == MODE_GESTURE) {
+            int hold_wait = gesture_timeout(display, &gesture);
+            if (timeout < 0 || (hold_wait >= 0 && hold_wait < timeout))
+                timeout = hold_wait;
+        }
+        if (replay.file) {
+            /* Inject the events that are due */
+            int replay_wait;
+            while ((replay_wait = replay_next(&replay, &event)) == 0) {
+                if (mode == MODE_WHEEL)
+                    wheel_event(xtest, &wheel, &event);
+                else if (mode == MODE_GESTURE)
+                    gesture_touch(xtest, &gesture, &event);
+                else
+                    replay_inject(xtest, &replay, &event);
+            }
+            XFlush(xtest);
+            if (replay_wait < 0)
+                break;
+            if (timeout < 0 || replay_wait < timeout)
+                timeout = replay_wait;
+        }
+        if (!display || !XPending(display)) {
+            int nfds = 2;
+            fds[0].fd = display ? ConnectionNumber(display) : hub_fd;
+            fds[0].revents = 0;
+            fds[1].fd = bridge_fd;
+            fds[1].revents = 0;
+            if (mode == MODE_HUB) {
+                nfds = 3 + nsubscribers;
+                for (i = 0; i < nsubscribers; i++)
+                    fds[3+i].fd = subscribers[i].fd;
+                for (i = 2; i < nfds; i++) {
+                    fds[i].events = POLLIN;
+                    fds[i].revents = 0;
                 }
             }
-            XFreeEventData(display, cookie);
+            if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+                perror("poll error");
+                break;
+            }
+            if (fds[1].revents)
+                bridge_drain();
+            if (mode == MODE_HUB) {
+                uint32_t old_mask = hub_mask();
+                /* Backwards, as removing moves the last subscriber */
+                for (i = nfds-4; i >= 0; i--) {
+                    if (fds[3+i].revents)
+                        hub_read(i);
+                }
+                if (fds[2].revents)
+                    hub_accept(listen_fd);
+                if (hub_mask() != old_mask) {
+                    mask = hub_mask();
+                    select_events(display, win, mask);
+                }
+            }
+            if (display || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+        }
+
+        have_event = 0;
+        if (!display) {
+            int n = recv(hub_fd, record, sizeof(record), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                /* The hub went away: connect to X11 directly. */
+                close(hub_fd);
+                hub_fd = -1;
+                display = open_display(&xi_opcode);
+                win = DefaultRootWindow(display);
+                select_events(display, win, mask);
+                continue;
+            }
+            have_event = hub_decode(record, n, &event) == 0;
+        } else {
+            XNextEvent(display, &xevent);
+            if (xevent.type == MapNotify || xevent.type == UnmapNotify) {
+                map_to_event(display, &xevent, &event);
+                have_event = 1;
+            } else if (XGetEventData(display, cookie)) {
+                if (cookie->extension == xi_opcode &&
+                        cookie->evtype == XI_HierarchyChanged) {
+                    memset(device_modes, 0, sizeof(device_modes));
+                } else if (cookie->extension == xi_opcode &&
+                        gesture.grab_window != None &&
+                        (cookie->evtype == XI_TouchBegin ||
+                         cookie->evtype == XI_TouchUpdate ||
+                         cookie->evtype == XI_TouchEnd)) {
+                    gesture_grabbed(display, &gesture, cookie->data);
+                } else if (cookie->extension == xi_opcode &&
+                        cookie->type == GenericEvent &&
+                        cookie->evtype < 31 &&
+                        (mask & EVENT_MASK_RAW(cookie->evtype))) {
+                    raw_to_event(display, cookie->data, &event);
+                    have_event = 1;
+                }
+                XFreeEventData(display, cookie);
+            }
+        }
+        if (!have_event)
+            continue;
+
+        /* Events from the X server only measure the delay of the replay */
+        if (replay.file) {
+            inject_received(&event);
+            continue;
+        }
+
+        switch (mode) {
+        case MODE_PRINT:
+            print_input(&event);
+            if (one_event)
+                terminate = 1;
+            break;
+        case MODE_IDLE:
+            if (event.kind == EVENT_RAW)
+                idle_input(&idle);
+            break;
+        case MODE_WHEEL:
+            wheel_event(xtest, &wheel, &event);
+            break;
+        case MODE_GESTURE:
+            gesture_touch(xtest, &gesture, &event);
+            break;
+        case MODE_HUB:
+            hub_publish(&event);
+            break;
+        case MODE_RECORD:
+            if (trace_write(trace, &event, &record_latency) < 0)
+                terminate = 1;
+            break;
+        case MODE_REPLAY:
+            break;
         }
     }
 
+    flush_motion();
+    fflush(stdout);
+    if (trace) {
+        if (fclose(trace) != 0) {
+            perror("Cannot write trace");
+            return 1;
+        }
+        latency_summary(&record_latency);
+    } else if (replay.file) {
+        fclose(replay.file);
+        inject_latency.lost += ninjected;
+        if (mode == MODE_GESTURE)
+            latency_summary(&gesture.latency);
+        latency_summary(&inject_latency);
+    }
     return 0;
 }